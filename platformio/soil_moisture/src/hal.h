@@ -0,0 +1,98 @@
+/***************************************************
+ Hardware abstraction for the Soil Moisture Guard
+
+ main.cpp only talks to the board through the
+ functions below. hal_avr.cpp implements them for
+ the Arduino Nano, sim/sim.cpp for the host
+ simulation in the native environment.
+ ****************************************************/
+
+#ifndef HAL_H
+#define HAL_H
+
+#ifdef ARDUINO
+#ifdef HEADLESS
+#include <Arduino.h>
+#else
+#include <Adafruit_ThinkInk.h>
+#endif
+#include <EEPROM.h>
+#include <util/crc16.h>
+#else
+#include "sim/sim_arduino.h"
+#endif
+
+// Board
+
+#define CALIBRATION_BUTTON 5 // hold low during power up to enter the calibration mode
+
+#ifndef HEADLESS
+#define DISP_ENA    A6
+#endif
+#define DEC_EN      A5
+#define MOIST_REF   A4
+#define RADIO_CS    1 // optional RFM69 on the SPI bus, the only free pin is TX so it excludes the Serial port
+
+// HC237 decoder: address lines A0..A2 on d2..d4 (PD2..PD4), enable on A5 (PC5).
+// Outputs Y0..Y3 drive the pumps, Y4..Y7 power sensor and potentiometer of a channel.
+#define DEC_ADDR_SHIFT 2 // PD2
+// 3 address bits are 8 outputs, so the board has at most 4 channels. A fourth address line
+// would need PD5, the calibration button, and only A0..A3 and A7 (A6 headless) are free for sensors.
+#define DEC_ADDR_BITS  3
+#define DEC_OUTPUTS    (1 << DEC_ADDR_BITS)
+#define DEC_ADDR_MASK  ((DEC_OUTPUTS - 1) << DEC_ADDR_SHIFT)
+#define DEC_EN_BIT     5 // PC5
+#define PUMP_DEC(channel)   (channel)
+#define SENSOR_DEC(channel) (DEC_OUTPUTS/2 + (channel))
+
+#ifndef HEADLESS
+#define DISPLAY_SIZE   200 // the panel is 200x200 pixels
+#define DISPLAY_COLUMN_BYTES (DISPLAY_SIZE/8)
+
+// One framebuffer column of both color planes, bit set = ink
+struct DisplayColumn_T {
+  uint8_t black[DISPLAY_COLUMN_BYTES];
+  uint8_t red[DISPLAY_COLUMN_BYTES];
+};
+#endif
+
+// All times are real milliseconds, independent of the clock division.
+
+void halBegin(uint8_t analog_input_mask); // the digital input buffers of these analog inputs (bit 0 = A0) are switched off
+uint32_t halMillis();                     // time awake, the clock stops during halSleep()
+void halDelay(uint16_t ms);               // busy wait
+uint32_t halSleep(uint32_t ms, uint8_t wake_pins = 0); // power down in watchdog periods for at most ms, returns the time slept
+#define HAL_WAKE_SERIAL  0x01 // traffic on RX ends halSleep()
+#define HAL_WAKE_DISPLAY 0x02 // so does the end of a refresh
+void halClockFast();                      // for rendering and SPI bursts, the core draws more but finishes sooner
+void halClockSlow();                      // the default, for everything that waits on something else
+boolean halButtonPressed();
+
+// fills sensor and reference with count samples each, MOIST_REF is read by the HAL
+void halSampleChannel(uint8_t sensor_analog_pin, uint16_t* sensor, uint16_t* reference, uint8_t count);
+uint16_t halSupplyMillivolts(); // VCC, works while a decoder output is on
+
+void halDecoderOff();
+void halSetDecoder(uint8_t val); // only output val is enabled
+
+#ifndef HEADLESS
+void halDisplayOn();
+void halDisplayColumn(uint8_t x, DisplayColumn_T& column); // may modify column
+void halDisplayRefresh(); // starts the refresh with the columns written since halDisplayOn(), returns while the panel is busy
+boolean halDisplayBusy();
+void halDisplayOff();     // once the panel isn't busy any more
+void halDisplayMessage(const __FlashStringHelper* message, const char* details); // details may be NULL, blocks until the refresh is done
+#endif
+
+void halSerialBegin();                                   // for the binary protocol, not with DEBUG
+int16_t halSerialRead();                                 // next byte or -1
+void halSerialWrite(const uint8_t* data, uint8_t length); // waits until it is sent
+boolean halSerialWoke();                                 // true once after halSleep() ended early on serial traffic
+
+void halRadioBegin();                                   // only when a radio is fitted, leaves it asleep
+boolean halRadioStart(const uint8_t* data, uint8_t length); // starts sending one packet of up to RADIO_MAX_PAYLOAD bytes, false if the radio didn't come up
+boolean halRadioSent();                                  // the packet went out, the radio keeps sending until halRadioSleep()
+void halRadioSleep();                                    // also drops a packet that didn't go out
+#define RADIO_MAX_PAYLOAD 64
+
+#endif
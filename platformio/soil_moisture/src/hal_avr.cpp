@@ -0,0 +1,555 @@
+/***************************************************
+ Hardware abstraction, Arduino Nano (ATmega328P)
+ ****************************************************/
+
+#include "hal.h"
+#include <SPI.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include <util/atomic.h>
+
+#ifndef HEADLESS
+#define EPD_CS      9
+#define EPD_DC      10
+#define SRAM_CS     6
+#define EPD_RESET   8
+#define EPD_BUSY    7
+#endif
+
+// see CLKPR chapter in ATmega328P manual
+// register | division factor
+// ---------|----------------
+//     0x00 |   1 ->  16MHz
+//     0x01 |   2 ->   8MHz
+//     0x02 |   4 ->   4MHz
+//     0x03 |   8 ->   2MHz
+//     0x04 |  16 ->   1MHz
+//     0x05 |  32 -> 500kHz
+//     0x06 |  64 -> 250kHz
+//     0x07 | 128 -> 125kHz
+//     0x08 | 256 ->  62kHz
+#define CLK_DIV_SLOW 0x03 // 2MHz for power saving while waiting, sampling and timing pumps ..
+#define CLK_DIV_FAST 0x01 // .. 8MHz for rendering and SPI bursts, within the safe operating area down to 2.4V
+#define DEBUG_BAUD           1200  // actual rates, Serial.begin() assumes 16MHz
+#define SERIAL_PROTOCOL_BAUD 19200
+#define BANDGAP_MV 1100 // nominal, the bandgap of a part is within 1.0..1.2V so calibrate against a meter
+#define ADMUX_BANDGAP 0x0E
+
+// RFM69 (not HCW) in FSK packet mode, transmit only
+#define RADIO_FRF        0xD90000 // 868MHz in 61Hz steps, 433MHz is 0x6C4000, 915MHz 0xE4C000
+#define RADIO_NETWORK_ID 0x2A     // second sync byte, boards with another id ignore our packets
+#define RADIO_PA_LEVEL   0x9F     // PA0 at +13dBm
+#define RADIO_TIMEOUT_MS 500
+#define RFM69_FIFO        0x00
+#define RFM69_OPMODE      0x01
+#define RFM69_VERSION     0x10
+#define RFM69_IRQFLAGS1   0x27
+#define RFM69_IRQFLAGS2   0x28
+#define RFM69_MODE_SLEEP  0x00
+#define RFM69_MODE_STDBY  0x04
+#define RFM69_MODE_TX     0x0C
+#define RFM69_MODE_READY  0x80
+#define RFM69_PACKET_SENT 0x08
+
+static_assert(CALIBRATION_BUTTON < DEC_ADDR_SHIFT || CALIBRATION_BUTTON >= DEC_ADDR_SHIFT + DEC_ADDR_BITS, "the calibration button collides with the decoder address lines");
+static_assert(DEC_ADDR_SHIFT == PD2, "the decoder address lines are on PORTD");
+static_assert(DEC_EN == A5 && DEC_EN_BIT == PC5, "halDecoderOff() writes PORTC directly");
+
+#ifndef HEADLESS
+// 1.54" Tricolor display with 200x200 pixels and SSD1681 chipset.
+// Adds a bulk write of whole framebuffer columns so updateDisplay() doesn't need a
+// read-modify-write SRAM transaction for every pixel drawn through Adafruit_GFX.
+class StreamedDisplay_T : public ThinkInk_154_Tricolor_Z90 {
+  public:
+    using ThinkInk_154_Tricolor_Z90::ThinkInk_154_Tricolor_Z90;
+    boolean deferred = false; // display() returns once the refresh waveform started, see halDisplayRefresh()
+
+    void update() override {
+      // the library busy waits at the end of its update sequence, all other busy waits are short
+      waiting_for_update = true;
+      ThinkInk_154_Tricolor_Z90::update();
+      waiting_for_update = false;
+    }
+
+    void busy_wait() override {
+      if (!(deferred && waiting_for_update)) {
+        ThinkInk_154_Tricolor_Z90::busy_wait();
+      }
+    }
+
+    void writeColumn(uint8_t x, DisplayColumn_T& column) {
+      // same layout as Adafruit_EPD::drawPixel(): one column of HEIGHT bits per
+      // framebuffer line, rightmost column first, top pixel in the MSB
+      const uint16_t offset = (uint16_t)(WIDTH - 1 - x)*DISPLAY_COLUMN_BYTES;
+      for (uint8_t b = 0; b < DISPLAY_COLUMN_BYTES; b++) {
+        column.black[b] ^= blackInverted ? 0xFF : 0x00;
+        column.red[b]   ^= colorInverted ? 0xFF : 0x00;
+      }
+      if (use_sram) {
+        sram.write(blackbuffer_addr + offset, column.black, DISPLAY_COLUMN_BYTES);
+        sram.write(colorbuffer_addr + offset, column.red, DISPLAY_COLUMN_BYTES);
+      } else {
+        memcpy(black_buffer + offset, column.black, DISPLAY_COLUMN_BYTES);
+        memcpy(color_buffer + offset, column.red, DISPLAY_COLUMN_BYTES);
+      }
+    }
+
+  private:
+    boolean waiting_for_update = false;
+};
+
+StreamedDisplay_T display(EPD_DC, EPD_RESET, EPD_CS, SRAM_CS, EPD_BUSY);
+#endif
+
+// ADC engine. Conversions alternate between the sensor and MOIST_REF and are
+// sequenced from the ADC complete interrupt while the MCU sits in ADC noise
+// reduction sleep.
+struct AdcEngine_T {
+  uint16_t* sensor;
+  uint16_t* reference;
+  uint8_t sensor_mux;
+  volatile uint8_t conversions; // even: sensor, odd: reference
+} adc_engine;
+
+// Watchdog periods selected by WDP3..0, the 128kHz oscillator is within +-10%
+const uint16_t wdt_period_ms[] PROGMEM = {16, 32, 64, 125, 250, 500, 1000, 2000, 4000, 8000};
+#define WDT_PERIODS (sizeof(wdt_period_ms)/sizeof(wdt_period_ms[0]))
+#define WDT_DISPLAY_PERIOD 4 // 250ms, waiting for the display the lost part of a period is a clock error
+volatile uint16_t wdt_wakeups;
+uint8_t clk_div = 0x00;     // the fuses start the core undivided, halBegin() switches to CLK_DIV_SLOW
+uint32_t clk_base_ms = 0;   // halMillis() at the last switch ..
+uint32_t clk_mark = 0;      // .. and millis() then
+uint32_t serial_baud = 0;   // the UART is rescaled with the clock once it's started
+volatile boolean pin_woke = false; // a pin halSleep() waits for changed
+boolean serial_woke = false;
+
+
+uint8_t adcMux(uint8_t analog_pin) {
+  return _BV(REFS0) | ((analog_pin - A0) & 0x07); // AVcc reference, same as analogRead() with DEFAULT
+}
+
+
+uint8_t adcPrescaler() {
+  // keep the ADC clock at 125kHz: Arduino uses /128 at 16MHz, less is needed when the core is divided
+  return max(1, 7 - clk_div);
+}
+
+
+void setupAdc(uint8_t analog_input_mask) {
+  ADCSRA = _BV(ADEN) | _BV(ADIE) | adcPrescaler();
+  // digital input buffers on the analog inputs only draw current
+  DIDR0 = analog_input_mask & 0x3F; // A6 and A7 have no digital input
+}
+
+
+void serialBegin(uint32_t baud) {
+  serial_baud = baud;
+  Serial.begin(baud << clk_div);
+}
+
+
+void setClock(uint8_t div) {
+  // timer0, the UART and the ADC all run from the divided clock. millis() is folded
+  // into clk_base_ms at the old rate, the fraction of a timer0 millisecond is lost.
+  if (div == clk_div) {
+    return;
+  }
+  if (serial_baud) {
+    Serial.flush(); // the rest would go out at the wrong rate
+  }
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    const uint32_t now = millis();
+    clk_base_ms += (now - clk_mark) << clk_div;
+    clk_mark = now;
+    CLKPR = _BV(CLKPCE); // timed sequence, 4 cycles to write the new setting
+    CLKPR = div;
+    clk_div = div;
+  }
+  ADCSRA = (ADCSRA & ~0x07) | adcPrescaler();
+  if (serial_baud) {
+    serialBegin(serial_baud);
+  }
+}
+
+
+ISR(ADC_vect) {
+  uint8_t n = adc_engine.conversions;
+  if (n & 0x01) {
+    adc_engine.reference[n>>1] = ADC;
+    ADMUX = adc_engine.sensor_mux;
+  } else {
+    adc_engine.sensor[n>>1] = ADC;
+    ADMUX = adcMux(MOIST_REF);
+  }
+  adc_engine.conversions = n + 1;
+}
+
+
+ISR(WDT_vect) {
+  // interrupt mode, no reset. halSleep() only counts the wake ups and goes back to sleep
+  wdt_wakeups++;
+}
+
+
+ISR(PCINT2_vect) {
+  // RX (PD0) or EPD_BUSY (PD7) changed while halSleep() waited for it
+  pin_woke = true;
+}
+
+
+void wdtStart(uint8_t period) {
+  const uint8_t wdp = (period & 0x07) | ((period & 0x08) ? _BV(WDP3) : 0);
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    wdt_reset();
+    MCUSR &= ~_BV(WDRF);
+    WDTCSR = _BV(WDCE) | _BV(WDE); // timed sequence, 4 cycles to write the new setting
+    WDTCSR = _BV(WDIE) | wdp;
+  }
+}
+
+
+void wdtStop() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    wdt_reset();
+    MCUSR &= ~_BV(WDRF);
+    WDTCSR = _BV(WDCE) | _BV(WDE);
+    WDTCSR = 0;
+  }
+}
+
+
+void halBegin(uint8_t analog_input_mask) {
+  // Deselect a radio before display.begin() talks on the SPI bus, its chip select would float.
+  // TELEMETRY may only be defined in main.cpp, and without a radio this is TX idling high.
+  digitalWrite(RADIO_CS, HIGH);
+  pinMode(RADIO_CS, OUTPUT);
+#ifdef DEBUG
+  serialBegin(DEBUG_BAUD);
+  while (!Serial) { delay(10); }
+#endif
+#ifndef HEADLESS
+  display.begin(THINKINK_TRICOLOR);
+  // display.setRotation(1); // experiment with this depending on how the board is installed. Values can be 0, 1, 2, 3
+#endif
+  setClock(CLK_DIV_SLOW);
+#ifdef DEBUG
+  Serial.print(F("Clock divisor "));
+  Serial.print(1 << CLK_DIV_SLOW);
+  Serial.print(F(", fast "));
+  Serial.println(1 << CLK_DIV_FAST);
+#endif
+#ifndef HEADLESS
+  pinMode(DISP_ENA, OUTPUT);
+#endif
+  pinMode(DEC_EN, OUTPUT);
+  DDRD |= DEC_ADDR_MASK;
+  pinMode(CALIBRATION_BUTTON, INPUT_PULLUP);
+  setupAdc(analog_input_mask);
+  ACSR = _BV(ACD); // the analog comparator isn't used
+}
+
+
+uint32_t halMillis() {
+  // timer0 runs from the divided clock, so millis() is slow by 1 << clk_div since the last switch.
+  // Wraps after 49 days of being awake but differences stay correct.
+  uint32_t now;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    now = clk_base_ms + ((millis() - clk_mark) << clk_div);
+  }
+  return now;
+}
+
+
+void halDelay(uint16_t ms) {
+  delay(ms >> clk_div);
+}
+
+
+uint32_t halSleep(uint32_t ms, uint8_t wake_pins) {
+  // Power down with the BOD off, woken by the watchdog which runs from its own 128kHz
+  // oscillator, no clock scaling needed. The longest period is used as often as it fits,
+  // the wake ups in between only run the ISR. The decoder outputs keep their level, so a
+  // selected sensor or pump stays powered.
+  // A pin change on RX (HAL_WAKE_SERIAL) ends the sleep, the byte that caused it is lost.
+  // So does EPD_BUSY going low (HAL_WAKE_DISPLAY), the periods are short then.
+  // Power down stops every clock, so gating them in PRR would save nothing and the USART
+  // and SPI would need to be set up again. Only the ADC draws on its own when enabled, the
+  // analog comparator is off since halBegin().
+  ADCSRA &= ~_BV(ADEN);
+  pin_woke = false;
+  PCMSK2 = ((wake_pins & HAL_WAKE_SERIAL) ? _BV(PCINT16) : 0) | ((wake_pins & HAL_WAKE_DISPLAY) ? _BV(PCINT23) : 0);
+  PCIFR = _BV(PCIF2);
+  if (PCMSK2) {
+    PCICR |= _BV(PCIE2);
+  }
+#ifndef HEADLESS
+  if ((wake_pins & HAL_WAKE_DISPLAY) && !halDisplayBusy()) {
+    pin_woke = true; // done before the interrupt was armed
+  }
+#endif
+  const int8_t longest = (wake_pins & HAL_WAKE_DISPLAY) ? WDT_DISPLAY_PERIOD : WDT_PERIODS - 1;
+  uint32_t slept = 0;
+  for (int8_t p = longest; p >= 0 && !pin_woke; p--) {
+    const uint16_t period = pgm_read_word(&wdt_period_ms[p]);
+    const uint16_t periods = (ms - slept)/period;
+    if (periods == 0) {
+      continue;
+    }
+    wdt_wakeups = 0;
+    wdtStart(p);
+    set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+    while (true) {
+      cli();
+      if (wdt_wakeups >= periods || pin_woke) {
+        sei();
+        break;
+      }
+      sleep_enable();
+      sleep_bod_disable(); // only lasts for the next 3 cycles
+      sei();
+      sleep_cpu();
+      sleep_disable();
+    }
+    wdtStop();
+    slept += (uint32_t)min(wdt_wakeups, periods)*period;
+    if (wdt_wakeups < periods) {
+      slept += period/2; // an interrupted period, on average half of it passed
+    }
+  }
+  PCICR &= ~_BV(PCIE2);
+  serial_woke = pin_woke && (wake_pins & HAL_WAKE_SERIAL);
+  ADCSRA |= _BV(ADEN);
+  return slept;
+}
+
+
+boolean halButtonPressed() {
+  return digitalRead(CALIBRATION_BUTTON) == LOW;
+}
+
+
+void halSampleChannel(uint8_t sensor_analog_pin, uint16_t* sensor, uint16_t* reference, uint8_t count) {
+#ifdef DEBUG
+  Serial.flush(); // the UART stops in ADC noise reduction mode
+#endif
+  adc_engine.sensor = sensor;
+  adc_engine.reference = reference;
+  adc_engine.sensor_mux = adcMux(sensor_analog_pin);
+  adc_engine.conversions = 0;
+  ADMUX = adc_engine.sensor_mux;
+  set_sleep_mode(SLEEP_MODE_ADC);
+  while (true) {
+    cli();
+    if (adc_engine.conversions >= 2*count) {
+      sei();
+      break;
+    }
+    sleep_enable();
+    sei();       // the instruction after sei is always executed, so the ISR can't slip in before we sleep
+    sleep_cpu(); // entering ADC noise reduction starts the next conversion
+    sleep_disable();
+  }
+}
+
+
+uint16_t halSupplyMillivolts() {
+  // measures the bandgap with AVcc as reference, so no pin is needed
+  ADCSRA &= ~_BV(ADIE); // polled, the interrupt belongs to halSampleChannel()
+  ADMUX = _BV(REFS0) | ADMUX_BANDGAP;
+  uint16_t adc = 0;
+  for (uint8_t n = 0; n < 8; n++) { // the first conversions after switching to the bandgap read high
+    ADCSRA |= _BV(ADSC);
+    while (ADCSRA & _BV(ADSC)) {}
+    adc = ADC;
+  }
+  ADCSRA |= _BV(ADIF) | _BV(ADIE); // clear the pending flag or the ISR would fire with stale buffers
+  return adc ? (uint32_t)BANDGAP_MV*1024/adc : 0;
+}
+
+
+void halClockFast() {
+  setClock(CLK_DIV_FAST);
+}
+
+
+void halClockSlow() {
+  setClock(CLK_DIV_SLOW);
+}
+
+
+void halDecoderOff() {
+  PORTC &= ~_BV(DEC_EN_BIT); // single sbi/cbi instruction
+}
+
+
+void halSetDecoder(uint8_t val) {
+  // The address lines are set with one PORTD write while the decoder is disabled,
+  // so no other output is enabled in between, not even for a few microseconds.
+  halDecoderOff();
+#ifdef DEBUG
+  Serial.print(F("setDecoder to "));
+  Serial.println(val);
+#endif
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    PORTD = (PORTD & ~DEC_ADDR_MASK) | ((val << DEC_ADDR_SHIFT) & DEC_ADDR_MASK);
+  }
+  PORTC |= _BV(DEC_EN_BIT);
+}
+
+
+#ifndef HEADLESS
+void halDisplayOn() {
+  digitalWrite(DISP_ENA, HIGH);
+  display.powerUp();
+}
+
+
+void halDisplayColumn(uint8_t x, DisplayColumn_T& column) {
+  display.writeColumn(x, column);
+}
+
+
+void halDisplayRefresh() {
+  display.deferred = true;
+  display.display();
+  display.deferred = false;
+}
+
+
+boolean halDisplayBusy() {
+  return digitalRead(EPD_BUSY) == HIGH;
+}
+
+
+void halDisplayOff() {
+  display.powerDown();
+  digitalWrite(DISP_ENA, LOW);
+}
+#endif
+
+
+void radioWrite(uint8_t reg, const uint8_t* data, uint8_t length) {
+  SPI.beginTransaction(SPISettings(4000000, MSBFIRST, SPI_MODE0));
+  digitalWrite(RADIO_CS, LOW);
+  SPI.transfer(reg | 0x80);
+  for (uint8_t b = 0; b < length; b++) {
+    SPI.transfer(data[b]);
+  }
+  digitalWrite(RADIO_CS, HIGH);
+  SPI.endTransaction();
+}
+
+
+void radioWriteReg(uint8_t reg, uint8_t value) {
+  radioWrite(reg, &value, 1);
+}
+
+
+uint8_t radioReadReg(uint8_t reg) {
+  SPI.beginTransaction(SPISettings(4000000, MSBFIRST, SPI_MODE0));
+  digitalWrite(RADIO_CS, LOW);
+  SPI.transfer(reg & 0x7F);
+  uint8_t value = SPI.transfer(0);
+  digitalWrite(RADIO_CS, HIGH);
+  SPI.endTransaction();
+  return value;
+}
+
+
+// register, value pairs for 4.8kbps with 5kHz deviation, variable length packets with CRC
+const uint8_t radio_config[][2] PROGMEM = {
+  {0x02, 0x00},                    // DataModul: packet mode, FSK, no shaping
+  {0x03, 0x1A}, {0x04, 0x0B},      // Bitrate 4.8kbps
+  {0x05, 0x00}, {0x06, 0x52},      // Fdev 5kHz
+  {0x07, (uint8_t)(RADIO_FRF >> 16)}, {0x08, (uint8_t)(RADIO_FRF >> 8)}, {0x09, (uint8_t)RADIO_FRF},
+  {0x11, RADIO_PA_LEVEL},
+  {0x2E, 0x88},                    // SyncConfig: 2 sync bytes
+  {0x2F, 0x2D}, {0x30, RADIO_NETWORK_ID},
+  {0x37, 0x90},                    // PacketConfig1: variable length, CRC on
+  {0x38, RADIO_MAX_PAYLOAD},
+  {0x3C, 0x8F},                    // FifoThresh: start as soon as the FIFO isn't empty
+};
+
+
+void halSerialBegin() {
+  serialBegin(SERIAL_PROTOCOL_BAUD);
+}
+
+
+int16_t halSerialRead() {
+  return Serial.read();
+}
+
+
+void halSerialWrite(const uint8_t* data, uint8_t length) {
+  Serial.write(data, length);
+  Serial.flush(); // power down would stop the UART clock in the middle of a byte
+}
+
+
+boolean halSerialWoke() {
+  const boolean woke = serial_woke;
+  serial_woke = false;
+  return woke;
+}
+
+
+void halRadioBegin() {
+  // Headless nothing else starts the bus. SPI.begin() also makes SS (D10) an output, as an
+  // input left floating it could switch the SPI to slave mode. With the display it's a no-op.
+  SPI.begin();
+  if (radioReadReg(RFM69_VERSION) != 0x24) {
+    return; // no radio, halRadioStart() will fail
+  }
+  for (uint8_t r = 0; r < sizeof(radio_config)/sizeof(radio_config[0]); r++) {
+    radioWriteReg(pgm_read_byte(&radio_config[r][0]), pgm_read_byte(&radio_config[r][1]));
+  }
+  radioWriteReg(RFM69_OPMODE, RFM69_MODE_SLEEP); // it comes up in standby which draws over 1mA
+}
+
+
+boolean halRadioStart(const uint8_t* data, uint8_t length) {
+  uint8_t frame[RADIO_MAX_PAYLOAD + 1];
+  frame[0] = length; // variable length packets start with their length
+  memcpy(frame + 1, data, length);
+  const uint32_t start = halMillis();
+  radioWriteReg(RFM69_OPMODE, RFM69_MODE_STDBY); // the crystal needs to run before the FIFO is filled
+  boolean ready = false;
+  while (!ready && halMillis() - start < RADIO_TIMEOUT_MS) {
+    ready = radioReadReg(RFM69_IRQFLAGS1) & RFM69_MODE_READY;
+  }
+  if (!ready) {
+    halRadioSleep();
+    return false;
+  }
+  radioWrite(RFM69_FIFO, frame, length + 1);
+  radioWriteReg(RFM69_OPMODE, RFM69_MODE_TX);
+  return true;
+}
+
+
+boolean halRadioSent() {
+  return radioReadReg(RFM69_IRQFLAGS2) & RFM69_PACKET_SENT;
+}
+
+
+void halRadioSleep() {
+  radioWriteReg(RFM69_OPMODE, RFM69_MODE_SLEEP); // also clears the FIFO
+}
+
+
+#ifndef HEADLESS
+void halDisplayMessage(const __FlashStringHelper* message, const char* details) {
+  halDisplayOn();
+  display.clearBuffer();
+  display.setTextSize(2);
+  display.setTextColor(EPD_BLACK);
+  display.setCursor(0, 0);
+  display.print(message);
+  if (details != NULL) {
+    display.print(details);
+  }
+  display.display();
+  halDisplayOff();
+}
+#endif
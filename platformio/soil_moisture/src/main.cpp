@@ -1,7 +1,8 @@
 /***************************************************
  Firmware for Soil Moisture Guard
  
- The board has four channels. Each channel has a
+ The board has up to four channels, one per entry
+ of channel_config[]. Each channel has a
  capacitive moisture sensor, a potentiometer to set
  the desired soil moisture level and a water pump.
  If the moisture drops below the desired level the
@@ -10,7 +11,7 @@
  a configurable number of pump retries are attempted before
  it gives up.
  
- A display shows the status of all 4 channels:
+ A display shows the status of all channels:
  - moisture level as bar graph
    black bar when ok, red when too dry
  - moisture level as numeric percentage
@@ -19,129 +20,1476 @@
    black font when ok, red when the maximum number of retries is exceeded
  ****************************************************/
 
-#include <Adafruit_ThinkInk.h>
-#include <Adafruit_SleepyDog.h>
+#include "hal.h" // pins and everything that touches the hardware
 
 #define VERSION "v0.1" // TODO: get from git
 //#define DEBUG 1 // comment in for debug info on the Serial port
+// HEADLESS (set by the nanoatmega328_headless environment) builds for a board without the
+// display: the EPD library, DISP_ENA and all rendering are compiled out.
 
-// Configuration
-#define NUMBER_OF_CHANNELS 4
-#define PUMP0_MAX_ATTEMPTS 3
-#define PUMP0_DURATION     10
-#define PUMP1_MAX_ATTEMPTS 3
-#define PUMP1_DURATION     10
-#define PUMP2_MAX_ATTEMPTS 3
-#define PUMP2_DURATION     10
-#define PUMP3_MAX_ATTEMPTS 3
-#define PUMP3_DURATION     10
-
-#define EPD_CS      9
-#define EPD_DC      10
-#define SRAM_CS     6
-#define EPD_RESET   8
-#define EPD_BUSY    7
-
-#define DISP_ENA    A6
-#define DEC_EN      A5
-#define MOIST_REF   A4
-
-// see CLKPR chapter in ATmega328P manual
-// register | division factor
-// ---------|----------------
-//     0x00 |   1 ->  16MHz
-//     0x01 |   2 ->   8MHz
-//     0x02 |   4 ->   4MHz
-//     0x03 |   8 ->   2MHz
-//     0x04 |  16 ->   1MHz
-//     0x05 |  32 -> 500kHz
-//     0x06 |  64 -> 250kHz
-//     0x07 | 128 -> 125kHz
-//     0x08 | 256 ->  62kHz
-const uint8_t clk_div    = 0x03; // Divide 16MHz for power saving ..
-const uint16_t clk_scaler = pow(2, clk_div); // ..  but all delays need to be scaled
-#define BAR_SCALER 1.38 // 100% moisture level is 138 pixels wide on the display
-
-// Calibration
+// Configuration. The channels themselves are configured in channel_config[] below,
+// the pins in hal.h
+
+// Channel configuration, one line per channel (1..8). The table lives in flash,
+// the mutable state of a channel is in channel_state[].
+struct ChannelConfig_T {
+  uint8_t pump_duration;     // seconds per pump attempt
+  uint8_t max_pump_attempts;
+  uint16_t pump_budget;      // pump seconds per day, a rolling budget that stops a channel that pumps without end
+  uint8_t sensor_analog_pin;
+  uint8_t sensor_dec;
+  uint8_t pump_dec;
+};
+
+constexpr ChannelConfig_T channel(uint8_t n, uint8_t pump_duration, uint8_t max_pump_attempts, uint16_t pump_budget, uint8_t sensor_analog_pin) {
+  return {pump_duration, max_pump_attempts, pump_budget, sensor_analog_pin, (uint8_t)SENSOR_DEC(n), (uint8_t)PUMP_DEC(n)};
+}
+
+constexpr ChannelConfig_T channel_config[] PROGMEM = {
+  //     #, pump duration, max pump attempts, pump budget s/day, sensor pin
+  channel(0, 10,            3,                 180,               A0),
+  channel(1, 10,            3,                 180,               A1),
+  channel(2, 10,            3,                 180,               A2),
+  channel(3, 10,            3,                 180,               A3)
+};
+#define NUMBER_OF_CHANNELS (sizeof(channel_config)/sizeof(channel_config[0]))
+
+#define BAR_LENGTH_100 138 // 100% moisture level is 138 pixels wide on the display
+
+// Calibration. These are the defaults for channels without a calibration record in EEPROM
 #define WET_MEASUREMENT 150 // sensor submersed in water -> 100% moisture level
 #define DRY_MEASUREMENT 660 // sensor in dry air -> 0% moisture level
-#define NUMBER_OF_MEASUREMENT_SAMPLES 4 // sensors are noisy, sample a few times and take average. Keep < 64 (2^16 uint16_t / 2^10 ADC resolution = 2^6)
+#define MIN_CALIBRATION_SPAN 100 // dry and wet must be at least this many ADC counts apart, otherwise the record is rejected
+// Sensors are noisy, so every reading is oversampled: 4^n samples are summed and
+// decimated by 2^n which gives n extra bits on top of the 10 bit ADC.
+// moisture_level_raw holds this 10+n bit value.
+#define OVERSAMPLING_EXTRA_BITS 1 // 1..3 -> 4, 16 or 64 samples per reading
+#define NUMBER_OF_MEASUREMENT_SAMPLES (1 << (2*OVERSAMPLING_EXTRA_BITS))
+#define RAW_SCALE (1 << OVERSAMPLING_EXTRA_BITS) // raw value of one 10 bit ADC count
+// optional rejection of outliers before decimation
+#define SAMPLE_FILTER_MEAN    0 // plain oversample and decimate
+#define SAMPLE_FILTER_MEDIAN  1 // median of all samples
+#define SAMPLE_FILTER_TRIMMED 2 // mean without the SAMPLE_TRIM lowest and highest samples
+#define SAMPLE_FILTER SAMPLE_FILTER_MEAN
+#define SAMPLE_TRIM (NUMBER_OF_MEASUREMENT_SAMPLES/4)
+#define MOISTURE_HYSTERESIS 2 // moisture level changes up to this many percentage points are treated as noise
+#define RAW_FILTER_SHIFT 2 // the raw value is an EWMA across cycles, a new reading weighs 1/4 ..
+#define RAW_SPIKE       (20*RAW_SCALE) // .. and one this many ADC counts off the filter is sampled again before it's believed
+#define SENSOR_SETTLE_MS 2000 // time the oscillator on the sensor needs to get steady after power up
+#define PUMP_SLICE_SEC 2 // dry channels take turns pumping in slices of this many seconds
+#define CLOSED_LOOP_WATERING 1 // comment out to always run the full pump_duration per attempt
+#define SOAK_SEC 30 // closed loop: time for the water to reach the sensor before a channel is measured again
+#define PUMP_BUDGET_MAX 3600 // s/day, the budget bucket is 12.4 fixed point
+
+// Fault detection. A faulted channel is neither powered nor pumped and doesn't set the pace of
+// the adaptive sleep, it's only measured every FAULT_RECHECK_CYCLES to see whether it recovered.
+#define FAULT_RAW_MIN          20 // ADC counts, below: sensor output shorted ..
+#define FAULT_RAW_MAX        1003 // .. above: open input or dead oscillator
+#define FAULT_STUCK_CYCLES      8 // the same raw value this many cycles in a row, a live sensor always has some noise
+#define FAULT_RESPONSE_POINTS   2 // all pump attempts together must raise the level this much, else pump or reservoir failed
+#define FAULT_RECHECK_CYCLES   24
+#define FAULT_NONE     0
+#define FAULT_RANGE    1
+#define FAULT_NO_WATER 2
+#define FAULT_STUCK    3
+
+// Adaptive sleep. The sleep between two cycles is shortened when a channel is
+// drying towards its reference level and stretched when all channels are stable.
+#define SLEEP_MIN_MINUTES      5 // shortest sleep, also used while a channel dries out fast
+#define SLEEP_DEFAULT_MINUTES 10 // used for pump retries and when there is no trend yet
+#define SLEEP_MAX_MINUTES     60 // longest sleep when all channels are stable and well above reference
+#define STABLE_MARGIN         10 // percentage points above reference at which a channel without a trend counts as stable
+#define DRYING_WEIGHT_SHIFT    3 // a new cycle weighs 1/8 in the drying rate estimate ..
+#define DRYING_MIN_CYCLES      4 // .. which is used once it has seen this many cycles
+#define DRYING_RISE_RESET      5 // a rise by more than this many points without a pump run is watering by hand, the estimate starts over
+#define PREDICTIVE_WATERING    1 // comment out to only water channels that are below their reference level
+#define PREDICT_LEAD_MINUTES  15 // predictive: a channel that reaches its reference within this time is watered on the wake up that happens anyway
+
+// Scheduler. A cycle runs as cooperative tasks, each a state machine whose step does a short
+// piece of work and then waits, either for a time or for a task it called. runTasks() steps
+// the task that is due and powers down while all of them wait, so sensor settling, pump
+// slices, soaking and the radio transmission are slept through instead of busy waited.
+#define TASK_CYCLE      0 // sense -> log -> pump -> display -> sleep, one loop()
+#define TASK_MEASURE    1 // settles and samples the channels in measuring.mask one after the other
+#define TASK_PUMP       2 // pump slices and closed loop soaking of one cycle
+#define TASK_DISPLAY    3
+#define TASK_TELEMETRY  4 // sends a full batch while the cycle goes on
+#define NUMBER_OF_TASKS 5
+#define TASK_NONE     0xFF
+#define TASK_IDLE        0 // state of a task that isn't running
+#define TASK_FIRST       1 // every task starts in its state 1
+#define DISPLAY_TIMEOUT_MS 30000 // a tricolor refresh takes about 15s, EPD_BUSY wakes the MCU when it's done
+#define TELEMETRY_POLL_MS    32 // two watchdog periods between looks at the radio
+#define TELEMETRY_TIMEOUT_MS 500
+
+// Supply. VCC is measured against the internal bandgap every cycle. On a weak battery
+// the loads are shed step by step, and a pump that drags VCC below VCC_PUMP_MIN_MV is
+// stopped before the brown-out detector resets the MCU into the next pump attempt.
+#define VCC_LOW_MV          3700 // below: low battery indicator, display refreshes at most every SHED_DISPLAY_MINUTES
+#define VCC_SHED_PUMP_MV    3500 // below: each pump attempt runs half its pump_duration, in half length slices
+#define VCC_SHED_SLEEP_MV   3300 // below: always the longest sleep
+#define VCC_PUMP_MIN_MV     3000 // under pump load. Pumps stay off until the resting voltage recovered by VCC_HYSTERESIS_MV
+#define VCC_HYSTERESIS_MV     50 // a shedding level is only left this far above its threshold
+#define SHED_DISPLAY_MINUTES 360
+#define SHED_NONE      0
+#define SHED_DISPLAY   1
+#define SHED_PUMP      2
+#define SHED_SLEEP     3
+#define SHED_PUMPS_OFF 4
+
+// Telemetry. With an RFM69 on RADIO_CS every cycle is recorded as a sample and the
+// samples go out batched in one packet, which keeps the radio asleep nearly all the time.
+// The packet is TelemetryBatch_T as it is in RAM, all fields are single bytes.
+//#define TELEMETRY 1 // comment in when a radio is fitted. It uses the TX pin, so not together with DEBUG
+#define TELEMETRY_NODE_ID 1
+#if defined(TELEMETRY) && defined(DEBUG)
+#error "the radio chip select is on the TX pin of the Serial port"
+#endif
+
+// Serial protocol. Binary frames for reading the state and changing the settings without a DEBUG build:
+//   0x7E | type | length | payload | CRC-16/XMODEM of type, length and payload, MSB first
+// Every request is answered with a frame of type | PROTOCOL_RESPONSE. Multi byte values in the
+// payload are little endian. The board listens for PROTOCOL_BOOT_LISTEN_MS after a reset, which
+// opening the port does on a Nano, and wakes from sleep on traffic on RX. The byte that wakes
+// it is lost, so a host sends a 0x00 first or simply repeats a request that wasn't answered.
+#define SERIAL_PROTOCOL 1 // comment out to keep the UART off
+#if defined(DEBUG) || defined(TELEMETRY)
+#undef SERIAL_PROTOCOL // the port or its TX pin is taken
+#endif
+#define PROTOCOL_SYNC           0x7E
+#define PROTOCOL_MAX_PAYLOAD      72
+#define PROTOCOL_BOOT_LISTEN_MS 2000
+#define PROTOCOL_IDLE_MS        1000 // a session ends when the host is quiet this long
+#define PROTOCOL_BYTE_MS          20 // gap within a frame after which it counts as truncated
+#define PROTOCOL_INFO            0x01 // -> channels, history pages, newest page, page size, version text
+#define PROTOCOL_STATE           0x02 // -> mV, sleep minutes, shed level, per channel: level, reference, raw:16, attempts, minutes to reference:16, fault
+#define PROTOCOL_STATS           0x03 // -> Stats_T as it is in RAM
+#define PROTOCOL_HISTORY         0x04 // page -> page, HISTORY_PAGE_SIZE bytes as in EEPROM
+#define PROTOCOL_CONFIG          0x05 // -> per channel: pump duration, max pump attempts, wet:16, dry:16, pump budget s/day:16
+#define PROTOCOL_SET_CHANNEL     0x06 // channel, pump duration, max pump attempts, pump budget s/day:16 -> status, stored in EEPROM
+#define PROTOCOL_SET_CALIBRATION 0x07 // channel, wet:16, dry:16 in 10 bit ADC counts -> status, stored in EEPROM
+#define PROTOCOL_DOSES           0x08 // -> per channel: pump seconds:32, doses:16, seconds in the budget:16
+#define PROTOCOL_RESPONSE        0x80
+#define PROTOCOL_ERROR           0xFF // -> status, for frames that could not be handled
+#define PROTOCOL_OK        0
+#define PROTOCOL_BAD_FRAME 1 // truncated, too long or CRC mismatch
+#define PROTOCOL_UNKNOWN   2 // type or length
+#define PROTOCOL_REJECTED  3 // value out of range
+
+// EEPROM layout
+#define EEPROM_CALIBRATION_ADDR 0     // NUMBER_OF_CHANNELS x CalibrationRecord_T
+#define EEPROM_STATS_ADDR       0x40  // Stats_T
+#define EEPROM_DOSE_ADDR        0x90  // NUMBER_OF_CHANNELS x DoseRecord_T
+#define EEPROM_SETTINGS_ADDR    0xC0  // NUMBER_OF_CHANNELS x SettingsRecord_T
+#define EEPROM_HISTORY_ADDR     0x100 // history log pages up to the end of the EEPROM
+#define CALIBRATION_MAGIC 0xA5
+#define SETTINGS_MAGIC    0x3D
+#define DOSE_MAGIC        0xD5
+
+static_assert(OVERSAMPLING_EXTRA_BITS >= 1 && OVERSAMPLING_EXTRA_BITS <= 3, "sample buffers must fit in SRAM");
+constexpr bool sensorsOnFreeAnalogPins(uint8_t i) {
+  return i == NUMBER_OF_CHANNELS ||
+         (channel_config[i].sensor_analog_pin >= A0 && channel_config[i].sensor_analog_pin <= A7 &&
+          channel_config[i].sensor_analog_pin != MOIST_REF && channel_config[i].sensor_analog_pin != DEC_EN &&
+#ifndef HEADLESS
+          channel_config[i].sensor_analog_pin != DISP_ENA &&
+#endif
+          sensorsOnFreeAnalogPins(i + 1));
+}
+
+constexpr uint8_t sensorInputMask(uint8_t i) {
+  // one bit per ADC input used by a sensor, as in DIDR0
+  return i == NUMBER_OF_CHANNELS ? 0 : (1 << (channel_config[i].sensor_analog_pin - A0)) | sensorInputMask(i + 1);
+}
+
+constexpr bool pumpAttemptsFit(uint8_t i) {
+  return i == NUMBER_OF_CHANNELS || (channel_config[i].max_pump_attempts <= 7 && pumpAttemptsFit(i + 1));
+}
+
+constexpr bool pumpBudgetsValid(uint8_t i) {
+  return i == NUMBER_OF_CHANNELS ||
+         (channel_config[i].pump_budget > 0 && channel_config[i].pump_budget >= channel_config[i].pump_duration &&
+          pumpBudgetsValid(i + 1));
+}
+
+// a constant, called at runtime a constexpr function would read channel_config[] from flash like RAM
+constexpr uint8_t sensor_input_mask = sensorInputMask(0);
+
+static_assert(pumpAttemptsFit(0), "pump_attempts is a 3 bit field in ChannelState_T");
+static_assert(pumpBudgetsValid(0), "a pump_budget must hold at least one pump run, the telemetry divides by it");
+static_assert(NUMBER_OF_CHANNELS >= 1 && NUMBER_OF_CHANNELS <= DEC_OUTPUTS/2, "every channel needs a pump and a sensor output on the decoder");
+static_assert(sensorsOnFreeAnalogPins(0), "sensors must be on analog pins that aren't used otherwise");
+static_assert(SOAK_SEC <= 65, "the soak time is slept in one uint16_t of milliseconds");
+static_assert(PUMP_SLICE_SEC >= 1 && PUMP_SLICE_SEC <= 65, "a pump slice is slept in one uint16_t of milliseconds");
+
+#ifndef HEADLESS
+// 5x8 glyphs of the classic Adafruit_GFX font for the characters updateDisplay() needs, one byte per column, LSB on top
+const char glyph_chars[] PROGMEM = "0123456789%.vsmAh!";
+const uint8_t glyphs[][5] PROGMEM = {
+  {0x3E, 0x51, 0x49, 0x45, 0x3E}, {0x00, 0x42, 0x7F, 0x40, 0x00}, {0x72, 0x49, 0x49, 0x49, 0x46},
+  {0x21, 0x41, 0x49, 0x4D, 0x33}, {0x18, 0x14, 0x12, 0x7F, 0x10}, {0x27, 0x45, 0x45, 0x45, 0x39},
+  {0x3C, 0x4A, 0x49, 0x49, 0x31}, {0x41, 0x21, 0x11, 0x09, 0x07}, {0x36, 0x49, 0x49, 0x49, 0x36},
+  {0x46, 0x49, 0x49, 0x29, 0x1E}, {0x23, 0x13, 0x08, 0x64, 0x62}, {0x00, 0x60, 0x60, 0x00, 0x00},
+  {0x1C, 0x20, 0x40, 0x20, 0x1C}, {0x48, 0x54, 0x54, 0x54, 0x20}, {0x7C, 0x04, 0x18, 0x04, 0x78},
+  {0x7C, 0x12, 0x11, 0x12, 0x7C}, {0x7F, 0x08, 0x04, 0x04, 0x78}, {0x00, 0x00, 0x5F, 0x00, 0x00}
+};
+
+// display layout, one row per channel
+const uint8_t footer_y      = DISPLAY_SIZE - 8;          // one line of text below the rows
+const uint8_t row_height    = footer_y/NUMBER_OF_CHANNELS;
+const uint8_t text_size     = row_height >= 40 ? 2 : 1; // large rows have room for the raw value below the percentage
+const uint8_t text_y_offset = (row_height - 8*text_size)/2 - text_size;
+const uint8_t marker_height = 2*text_size;              // reference marker triangles above and below the bar
+const uint8_t bar_y_offset  = marker_height + row_height/12;
+const uint8_t bar_height    = row_height - 2*bar_y_offset;
+#endif
+
+// Global state, packed tightly since SRAM is shared with the display driver
+struct ChannelState_T {
+  uint16_t moisture_level           : 7;  // 0..99%
+  uint16_t moisture_reference_level : 7;  // 0..102%
+  uint16_t moisture_level_raw       : 13; // 10+OVERSAMPLING_EXTRA_BITS bit
+  uint16_t pump_attempts            : 3;
+  uint16_t calibration_dry;     // raw value at 0%
+  uint16_t percent_per_raw_q16; // percent per raw count as 0.16 fixed point, avoids pulling in soft float
+  uint16_t raw_filter_q3;       // EWMA of the raw value as 13.3 fixed point, 0 until the first reading
+} channel_state[NUMBER_OF_CHANNELS]; // initialized in setup()
+
+struct ChannelHealth_T {
+  uint8_t fault;        // FAULT_*
+  uint8_t recheck;      // cycles until a faulted channel is measured again
+  uint8_t repeats;      // readings in a row with the raw value of the one before
+  uint16_t last_raw;    // unfiltered
+  uint8_t pumped_from;  // level before the first pump attempt
+  boolean judge;        // the last attempt is spent, the next plan checks whether the level rose
+} health[NUMBER_OF_CHANNELS];
+
+// Drying rate per channel as EWMAs of the drop per cycle and of the cycle length,
+// their ratio is the slope over roughly the last 1 << DRYING_WEIGHT_SHIFT cycles.
+#define DRYING_NO_BASELINE 0xFF
+#define DRYING_NO_PREDICTION 0xFFFF
+struct Drying_T {
+  int16_t drop_q8;  // percentage points per cycle in 8.8 fixed point, a rise is negative
+  uint16_t seconds; // per cycle
+  uint8_t level;    // last measurement without the hysteresis of moisture_level
+  uint8_t baseline; // level at the last recordDrying() or after soaking, DRYING_NO_BASELINE after an unmeasured pump run
+  uint8_t cycles;   // in the estimate, up to DRYING_MIN_CYCLES
+} drying[NUMBER_OF_CHANNELS]; // initialized in setup()
+uint32_t drying_ms = 0; // nowMs() of the last recordDrying()
+uint8_t sleep_minutes = 0; // length of the last sleep, there's none before the first cycle
+
+struct Supply_T {
+  uint16_t millivolts;       // resting VCC of this cycle
+  uint16_t pump_lock_mv;     // set when a pump made VCC sag, 0 otherwise
+  uint16_t minutes_since_refresh;
+  uint8_t shed_level;        // SHED_*
+  uint8_t displayed_level;   // shed_level shown on the display
+} supply;
+
+struct Task_T {
+  uint8_t state;   // TASK_IDLE or a state of the task's step function
+  uint8_t caller;  // resumed when the task ends, TASK_NONE if no task waits for it
+  boolean waiting; // for the task it called, due_ms doesn't count then
+  uint32_t due_ms; // nowMs() of the next step
+} tasks[NUMBER_OF_TASKS];
+uint32_t tasks_awake_ms = 0; // halMillis() up to which the awake time is booked
+boolean serial_listen = true; // cleared when a wake up on RX brought no request, until the next cycle
+
+// states per task
+#define CYCLE_SENSE    TASK_FIRST
+#define CYCLE_LOG      2
+#define CYCLE_DISPLAY  3
+#define CYCLE_END      4
+#define CYCLE_SLEEP    5
+#define MEASURE_POWER  TASK_FIRST
+#define MEASURE_SAMPLE 2
+#define PUMP_PLAN      TASK_FIRST
+#define PUMP_ROUND     2
+#define PUMP_OFF       3
+#define PUMP_SOAKED    4
+#define PUMP_JUDGE     5
+#define DISPLAY_UPDATE TASK_FIRST
+#define DISPLAY_WAIT   2
+#define TELEMETRY_SEND TASK_FIRST
+#define TELEMETRY_WAIT 2
+
+struct Cycle_T {
+  uint32_t cpu_start;   // halMillis() at the start
+  uint32_t phase_start; // nowMs() at the start of the running phase
+} cycle;
+
+struct Measuring_T {
+  uint8_t mask;        // channels still to measure
+  uint8_t restart;     // channels whose filter starts over, the water of a pump run is a real step
+  uint8_t channel;     // the one that is powered
+  uint32_t powered_ms;
+} measuring;
+
+struct Pumping_T {
+  uint8_t remaining[NUMBER_OF_CHANNELS]; // pump seconds left per channel
+  uint8_t pumped[NUMBER_OF_CHANNELS];    // pump seconds done per channel
+  uint8_t pending;                       // channels with seconds left
+  uint8_t slice_sec;
+  uint8_t channel;                       // next in the round
+  uint8_t slice;                         // seconds of the running slice
+  uint8_t unmeasured;                    // bit i: channel i pumped since it was measured
+  uint8_t attempted;                     // bit i: planPumps() counted an attempt for channel i
+  uint32_t powered_ms;
+} pumping;
+
+#ifdef TELEMETRY
+struct TelemetrySample_T {
+  uint8_t minutes;                             // sleep before the cycle
+  uint8_t supply;                              // VCC in 20mV steps above 2V
+  uint8_t moisture_level[NUMBER_OF_CHANNELS];
+  uint8_t pump_seconds[NUMBER_OF_CHANNELS];    // pump events of the cycle
+};
+#define TELEMETRY_BATCH ((RADIO_MAX_PAYLOAD - 3 - 4*NUMBER_OF_CHANNELS)/sizeof(TelemetrySample_T))
+
+struct TelemetryBatch_T {
+  uint8_t node;
+  uint8_t seq;                                 // a gap tells the receiver a packet got lost
+  uint8_t samples;
+  uint8_t moisture_reference_level[NUMBER_OF_CHANNELS]; // these rarely change, once per batch is enough
+  uint8_t pump_attempts[NUMBER_OF_CHANNELS];
+  uint8_t pump_budget_used[NUMBER_OF_CHANNELS]; // percent, 100 stops the channel
+  uint8_t fault[NUMBER_OF_CHANNELS];            // FAULT_*
+  TelemetrySample_T sample[TELEMETRY_BATCH];   // oldest first
+} telemetry;
+uint32_t telemetry_start_ms;
+static_assert(sizeof(TelemetryBatch_T) <= RADIO_MAX_PAYLOAD, "a telemetry batch goes out in one packet");
+#endif
+
+// History log. A ring of pages in EEPROM holding a bit packed stream of records, MSB first:
+//   sample    0   | minutes:7 | changed:NUMBER_OF_CHANNELS | signed delta:4 per changed channel
+//   pump      100 | channel:3 | seconds:8
+//   reference 101 | channel:3 | level:7
+//   sync      110 | minutes:7 | level:7 per channel
+//   end       111 (erased EEPROM)
+// minutes is the time since the previous sample or sync. A sample is only logged when a level
+// changed or after HISTORY_HEARTBEAT_MINUTES, larger jumps are logged as sync. Every page starts
+// with a sequence number and a sync so it decodes on its own. Pages are written round robin,
+// which spreads the EEPROM wear evenly, and the newest page is found again after a reset.
+#ifdef HEADLESS
+#define HISTORY_PAGE_SIZE 64 // the RAM of the display driver buys pages with half the sequence and sync overhead
+#else
+#define HISTORY_PAGE_SIZE 32
+#endif
+#define HISTORY_PAGES ((E2END + 1 - EEPROM_HISTORY_ADDR) / HISTORY_PAGE_SIZE)
+#define HISTORY_HEARTBEAT_MINUTES 60
+#define HISTORY_SEQ_ERASED 0xFF // sequence numbers count 0..254
+#define HISTORY_PUMP      0x4
+#define HISTORY_REFERENCE 0x5
+#define HISTORY_SYNC      0x6
+#define HISTORY_END       0x7
+#define HISTORY_SYNC_BITS (3 + 7 + 7*NUMBER_OF_CHANNELS)
+static_assert(SLEEP_MAX_MINUTES + HISTORY_HEARTBEAT_MINUTES < 128, "the history log stores minutes in 7 bit");
+static_assert(NUMBER_OF_CHANNELS <= 8, "the history log stores channel numbers in 3 bit");
+static_assert(1 + HISTORY_PAGE_SIZE <= PROTOCOL_MAX_PAYLOAD && 4 + 8*NUMBER_OF_CHANNELS <= PROTOCOL_MAX_PAYLOAD, "a history page and the state go out in one frame");
+
+struct HistoryLog_T {
+  uint8_t page[HISTORY_PAGE_SIZE];   // RAM copy of the page being written
+  uint16_t bit_pos;                  // next bit to write in page
+  uint8_t page_index;
+  uint8_t minutes;                   // time not logged yet
+  uint8_t level[NUMBER_OF_CHANNELS]; // last logged moisture levels, base for the deltas
+} history;
+
+// Instrumentation. Phase times are wall clock and include the time slept while
+// a sensor settles or a pump runs, cpu_awake_ms only counts the time the core runs.
+#define STATS_MAGIC 0x5D
+#define STATS_SAVE_SECONDS 86400UL // sleep time between two saves of the counters to EEPROM, the cycle length varies
+#define STATS_ON_DISPLAY 1   // comment out to hide the awake time of the last cycle and the charge used in the lower left corner
+#define PHASE_SENSE   0
+#define PHASE_LOG     1
+#define PHASE_PUMP    2
+#define PHASE_DISPLAY 3
+#define NUMBER_OF_PHASES 4
+
+// Energy estimate. The time every load is on is integrated with its current draw,
+// measure the figures of a board once with a meter and put them here.
+#define CURRENT_SLEEP_UA      50 // power down with the watchdog running, regulator quiescent current included
+#define CURRENT_AWAKE_UA    1500 // core at 2MHz
+#define CURRENT_FAST_UA     3000 // on top of the core while halClockFast() runs it at 8MHz
+#define CURRENT_ADC_UA       300 // on top of the core while sampling
+#define CURRENT_SENSOR_UA   5000 // sensor and potentiometer of one channel
+#define CURRENT_PUMP_UA   150000
+#define CURRENT_DISPLAY_UA  5000 // panel and SRAM while DISP_ENA is on
+#define CURRENT_RADIO_UA   45000 // RFM69 transmitting at +13dBm
+#define ADC_CONVERSION_US    104 // 13 ADC clocks at 125kHz, too short for millis() so it's counted instead
+#define LOAD_SLEEP   0
+#define LOAD_AWAKE   1
+#define LOAD_ADC     2
+#define LOAD_SENSOR  3
+#define LOAD_PUMP    4
+#define LOAD_DISPLAY 5
+#define LOAD_RADIO   6
+#define LOAD_FAST    7
+#define NUMBER_OF_LOADS 8
+const uint32_t load_current_ua[NUMBER_OF_LOADS] PROGMEM = {
+  CURRENT_SLEEP_UA, CURRENT_AWAKE_UA, CURRENT_ADC_UA, CURRENT_SENSOR_UA, CURRENT_PUMP_UA, CURRENT_DISPLAY_UA, CURRENT_RADIO_UA, CURRENT_FAST_UA
+};
+static_assert((uint64_t)CURRENT_PUMP_UA*(PUMP_SLICE_SEC + 1)*1000 < 0xFFFFFFFF - 1000000, "the charge of a pump slice is booked in one uint32_t of uA*ms");
+static_assert((uint64_t)CURRENT_SLEEP_UA*SLEEP_MAX_MINUTES*60000 < 0xFFFFFFFF - 1000000, "the charge of a sleep is booked in one uint32_t of uA*ms");
+
+struct Stats_T {
+  uint8_t magic;
+  uint16_t boots;
+  uint32_t wakes;
+  uint16_t display_refreshes;
+  uint32_t pump_seconds;
+  uint32_t sleep_seconds;
+  uint32_t cpu_awake_ms;
+  uint32_t phase_ms[NUMBER_OF_PHASES];
+  uint32_t charge_mas[NUMBER_OF_LOADS]; // estimated, in mA*s
+} stats;
+static_assert(EEPROM_STATS_ADDR + sizeof(Stats_T) <= EEPROM_DOSE_ADDR, "Stats_T overlaps the dose counters");
+static_assert(sizeof(Stats_T) <= PROTOCOL_MAX_PAYLOAD, "the stats go out in one frame");
+uint16_t last_phase_ms[NUMBER_OF_PHASES]; // of the last cycle
+uint16_t last_cpu_awake_ms;
+uint16_t stats_saved_period; // stats.sleep_seconds/STATS_SAVE_SECONDS at the last save
+uint32_t slept_ms = 0; // time spent in watchdog sleep, timer0 doesn't run there
+
+// charge of the running cycle and the one before, which includes its sleep
+struct Energy_T {
+  uint32_t rest[NUMBER_OF_LOADS];     // in uA*ms, below 1mAs, not in stats.charge_mas yet
+  uint16_t adc_us;                    // conversion time below 1ms, not booked yet
+  uint32_t cycle_uas;
+  uint32_t cycle_start_ms;
+  uint32_t last_cycle_uas;
+  uint32_t last_average_ua;
+} energy;
+
+#ifndef HEADLESS
+// What is currently shown on the display for each channel. A tricolor refresh
+// is the biggest energy spike of a cycle, so it's skipped when nothing visible changed.
+struct DisplayedState_T {
+  uint16_t moisture_level           : 7;
+  uint16_t moisture_reference_level : 7;
+  uint16_t moisture_level_raw       : 13;
+  uint16_t pump_attempts            : 3;
+  uint8_t over_budget               : 1;
+  uint8_t fault                     : 2;
+} displayed_state[NUMBER_OF_CHANNELS];
+boolean display_valid = false; // false until the first refresh
+uint32_t display_powered_ms;
+#endif
+
+// per channel calibration as stored in EEPROM, in 10 bit ADC counts
+struct CalibrationRecord_T {
+  uint16_t wet;
+  uint16_t dry;
+  uint8_t check; // CALIBRATION_MAGIC xor all bytes above
+};
+
+// The settings of channel_config[] that can be changed over the serial protocol. A valid
+// record in EEPROM overrides the table, channelConfig() returns the merged configuration.
+struct ChannelSettings_T {
+  uint8_t pump_duration;
+  uint8_t max_pump_attempts;
+  uint16_t pump_budget;
+} channel_settings[NUMBER_OF_CHANNELS]; // initialized in loadSettings()
+
+struct SettingsRecord_T {
+  ChannelSettings_T settings;
+  uint8_t check; // SETTINGS_MAGIC xor all bytes above
+};
+static_assert(EEPROM_SETTINGS_ADDR + NUMBER_OF_CHANNELS*sizeof(SettingsRecord_T) <= EEPROM_HISTORY_ADDR, "the channel settings overlap the history log");
+
+// Pump accounting per channel. The budget is a leaky bucket: pumping fills it, it drains
+// at pump_budget per day, and a full one stops the channel. Stored after every pump run,
+// a reset doesn't empty it since the time the board was off is unknown.
+#define BUDGET_DRAIN_DIVISOR (86400/16) // seconds per day over the 4 fraction bits of bucket_q4
+struct DoseRecord_T {
+  uint32_t pump_seconds; // since the EEPROM was erased
+  uint16_t doses;        // cycles that pumped the channel
+  uint16_t bucket_q4;    // pump seconds in the budget as 12.4 fixed point
+  uint8_t check;         // DOSE_MAGIC xor all bytes above
+} doses[NUMBER_OF_CHANNELS]; // initialized in loadDoses()
+uint16_t budget_rest[NUMBER_OF_CHANNELS]; // drain below 1/16s, not taken off the bucket yet
+uint32_t budget_ms = 0; // nowMs() of the last drainBudgets()
+static_assert(EEPROM_DOSE_ADDR + NUMBER_OF_CHANNELS*sizeof(DoseRecord_T) <= EEPROM_SETTINGS_ADDR, "the dose counters overlap the channel settings");
+static_assert((uint32_t)PUMP_BUDGET_MAX*16 <= 0xFFFFUL - 255UL*16, "the bucket holds the budget and one more pump run");
+
+///////////////////////////////////////////////////////////////////////////////
+// code section below
+/////////////////////
+
+ChannelConfig_T channelConfig(uint8_t i) {
+  ChannelConfig_T config;
+  memcpy_P(&config, &channel_config[i], sizeof(config));
+  config.pump_duration     = channel_settings[i].pump_duration;
+  config.max_pump_attempts = channel_settings[i].max_pump_attempts;
+  config.pump_budget       = channel_settings[i].pump_budget;
+  return config;
+}
+
+
+uint32_t nowMs() {
+  // a clock that keeps running during watchdog sleep
+  return halMillis() + slept_ms;
+}
+
+
+uint32_t endPhase(uint8_t phase, uint32_t start) {
+  // books the time since start to phase and returns the start of the next phase
+  uint32_t now = nowMs();
+  uint32_t duration = now - start;
+  stats.phase_ms[phase] += duration;
+  last_phase_ms[phase] = min(duration, 0xFFFF);
+  return now;
+}
+
+
+void bookCharge(uint8_t load, uint32_t ms) {
+  // integrates the estimated charge of a load that was on for ms, current*ms must fit in an uint32_t
+  const uint32_t charge = pgm_read_dword(&load_current_ua[load])*ms; // uA*ms
+  const uint32_t rest = energy.rest[load] + charge;
+  stats.charge_mas[load] += rest/1000000;
+  energy.rest[load] = rest % 1000000;
+  energy.cycle_uas += (charge + 500)/1000;
+}
+
+
+void endCycle() {
+  // called when a cycle starts, closes the one before including its sleep
+  const uint32_t now = nowMs();
+  if (energy.cycle_start_ms != 0) {
+    energy.last_cycle_uas = energy.cycle_uas;
+    energy.last_average_ua = energy.cycle_uas/((now - energy.cycle_start_ms)/1000 + 1);
+  }
+  energy.cycle_uas = 0;
+  energy.cycle_start_ms = now;
+}
+
+
+uint32_t chargeMah() {
+  // estimated total since the stats were reset
+  uint32_t mas = 0;
+  for (uint8_t l = 0; l < NUMBER_OF_LOADS; l++) {
+    mas += stats.charge_mas[l];
+  }
+  return mas/3600;
+}
+
+
+void saveStats() {
+  EEPROM.put(EEPROM_STATS_ADDR, stats);
+  stats_saved_period = stats.sleep_seconds/STATS_SAVE_SECONDS;
+}
+
+
+void loadStats() {
+  EEPROM.get(EEPROM_STATS_ADDR, stats);
+  if (stats.magic != STATS_MAGIC) {
+    memset(&stats, 0, sizeof(stats));
+    stats.magic = STATS_MAGIC;
+  }
+  stats.boots++; // frequent boots hint at brown-outs
+  saveStats();
+}
+
+
+void printStats() {
+#ifdef DEBUG
+  Serial.print(F("Stats boots: "));
+  Serial.print(stats.boots);
+  Serial.print(F(" wakes: "));
+  Serial.print(stats.wakes);
+  Serial.print(F(" refreshes: "));
+  Serial.print(stats.display_refreshes);
+  Serial.print(F(" pump s: "));
+  Serial.print(stats.pump_seconds);
+  Serial.print(F(" sleep s: "));
+  Serial.print(stats.sleep_seconds);
+  Serial.print(F(" cpu awake ms: "));
+  Serial.println(stats.cpu_awake_ms);
+  Serial.print(F("Last cycle ms sense/log/pump/display: "));
+  for (uint8_t p = 0; p < NUMBER_OF_PHASES; p++) {
+    Serial.print(last_phase_ms[p]);
+    Serial.print(p < NUMBER_OF_PHASES - 1 ? '/' : ' ');
+  }
+  Serial.print(F("cpu awake: "));
+  Serial.println(last_cpu_awake_ms);
+  Serial.print(F("Charge mAs sleep/awake/adc/sensor/pump/display/radio/fast: "));
+  for (uint8_t l = 0; l < NUMBER_OF_LOADS; l++) {
+    Serial.print(stats.charge_mas[l]);
+    Serial.print(l < NUMBER_OF_LOADS - 1 ? '/' : ' ');
+  }
+  Serial.print(F("total mAh: "));
+  Serial.println(chargeMah());
+  Serial.print(F("Previous cycle uAs: "));
+  Serial.print(energy.last_cycle_uas);
+  Serial.print(F(" average uA: "));
+  Serial.print(energy.last_average_ua);
+  Serial.print(F(" -> mAh/day: "));
+  Serial.println(energy.last_average_ua*24/1000);
+#endif
+}
+
+
+uint8_t convertMeasurementToPercent(uint16_t measurement, const ChannelState_T& channel) {
+  // saturates at 0 or 99%
+  if (measurement >= channel.calibration_dry) {
+    return 0;
+  }
+  uint32_t percentage = ((uint32_t)(channel.calibration_dry - measurement)*channel.percent_per_raw_q16) >> 16;
+  return (uint8_t)min(99, percentage);
+}
+
+
+uint16_t decimateSamples(uint16_t* samples) {
+  // returns the 10+OVERSAMPLING_EXTRA_BITS bit value of the samples. Sorts the buffer in place for median and trimmed mean.
+#if SAMPLE_FILTER != SAMPLE_FILTER_MEAN
+  for (uint8_t j = 1; j < NUMBER_OF_MEASUREMENT_SAMPLES; j++) { // insertion sort, the buffer is small
+    uint16_t sample = samples[j];
+    uint8_t k = j;
+    for (; k > 0 && samples[k-1] > sample; k--) {
+      samples[k] = samples[k-1];
+    }
+    samples[k] = sample;
+  }
+#endif
+#if SAMPLE_FILTER == SAMPLE_FILTER_MEDIAN
+  const uint8_t mid = NUMBER_OF_MEASUREMENT_SAMPLES/2;
+  return (uint16_t)(samples[mid-1] + samples[mid]) << (OVERSAMPLING_EXTRA_BITS - 1); // mean of the two middle samples, scaled by RAW_SCALE
+#elif SAMPLE_FILTER == SAMPLE_FILTER_TRIMMED
+  uint32_t sum = 0;
+  for (uint8_t j = SAMPLE_TRIM; j < NUMBER_OF_MEASUREMENT_SAMPLES - SAMPLE_TRIM; j++) {
+    sum += samples[j];
+  }
+  return (sum*RAW_SCALE) / (NUMBER_OF_MEASUREMENT_SAMPLES - 2*SAMPLE_TRIM);
+#else
+  uint32_t sum = 0;
+  for (uint8_t j = 0; j < NUMBER_OF_MEASUREMENT_SAMPLES; j++) {
+    sum += samples[j];
+  }
+  return sum >> OVERSAMPLING_EXTRA_BITS;
+#endif
+}
+
+
+uint32_t sleepMs(uint32_t ms, uint8_t wake_pins = 0) {
+  // power down, returns the time slept which is ms rounded down to watchdog periods unless a pin ended it
+  const uint32_t slept = halSleep(ms, wake_pins);
+  slept_ms += slept;
+  bookCharge(LOAD_SLEEP, slept);
+  return slept;
+}
+
+
+void taskWait(uint8_t t, uint8_t state, uint32_t ms) {
+  // the next step of task t runs in state after ms
+  tasks[t].state = state;
+  tasks[t].waiting = false;
+  tasks[t].due_ms = nowMs() + ms;
+}
+
+
+void taskStart(uint8_t t) {
+  // nobody waits for the task, it runs along
+  taskWait(t, TASK_FIRST, 0);
+  tasks[t].caller = TASK_NONE;
+}
+
+
+void taskCall(uint8_t t, uint8_t state, uint8_t callee) {
+  // starts callee, t continues in state once callee ended
+  taskWait(callee, TASK_FIRST, 0);
+  tasks[callee].caller = t;
+  tasks[t].state = state;
+  tasks[t].waiting = true;
+}
+
+
+void taskEnd(uint8_t t) {
+  tasks[t].state = TASK_IDLE;
+  const uint8_t caller = tasks[t].caller;
+  if (caller != TASK_NONE) {
+    tasks[caller].waiting = false;
+    tasks[caller].due_ms = nowMs();
+  }
+}
+
+
+void sleepWithDecoderOn(uint16_t ms) {
+  // Instead of busy waiting we sleep in power down, the selected sensor or pump stays powered (see halSleep()).
+#ifdef DEBUG
+  halDelay(ms); // sleeping would garble the serial output
+#else
+  sleepMs(ms);
+#endif
+}
+
+
+void waitForSensorSettle() {
+  // one sensor at a time, see stepMeasure()
+  sleepWithDecoderOn(SENSOR_SETTLE_MS);
+}
+
+
+void powerChannel(uint8_t i) {
+  // sensor and potentiometer, the sensor needs SENSOR_SETTLE_MS before sampleChannel()
+  halSetDecoder(channelConfig(i).sensor_dec);
+#ifdef DEBUG
+  Serial.print(F("Reading Channel"));
+  Serial.println(i+1);
+#endif
+}
+
+
+void channelOff(uint32_t powered) {
+  halDecoderOff(); // sensor power down
+  bookCharge(LOAD_SENSOR, nowMs() - powered);
+}
+
+
+void sampleChannel(uint8_t i, uint16_t& measurement, uint16_t& measurement_ref) {
+  // raw sensor value (10+OVERSAMPLING_EXTRA_BITS bit) and 10 bit potentiometer value, the channel stays powered
+  uint16_t sensor[NUMBER_OF_MEASUREMENT_SAMPLES];
+  uint16_t reference[NUMBER_OF_MEASUREMENT_SAMPLES];
+  halSampleChannel(channelConfig(i).sensor_analog_pin, sensor, reference, NUMBER_OF_MEASUREMENT_SAMPLES);
+  energy.adc_us += 2*NUMBER_OF_MEASUREMENT_SAMPLES*ADC_CONVERSION_US;
+  bookCharge(LOAD_ADC, energy.adc_us/1000);
+  energy.adc_us %= 1000;
+  measurement = decimateSamples(sensor);
+  uint32_t sum_ref = 0;
+  for (uint8_t j = 0; j < NUMBER_OF_MEASUREMENT_SAMPLES; j++) {
+    sum_ref += reference[j];
+  }
+  measurement_ref = sum_ref / NUMBER_OF_MEASUREMENT_SAMPLES; // the reference shouldn't be noisy so it's not really necessary to average it but .. do it anyway for .. reasons
+}
+
+
+void readChannel(uint8_t i, uint16_t& measurement, uint16_t& measurement_ref) {
+  // blocking, for the calibration. The cycle measures in TASK_MEASURE.
+  const uint32_t powered = nowMs();
+  powerChannel(i);
+  waitForSensorSettle(); // wait until oscillator on sensor is steady
+  sampleChannel(i, measurement, measurement_ref);
+  channelOff(powered);
+}
+
+
+boolean isSpike(uint8_t i, uint16_t measurement) {
+  const uint16_t filtered = channel_state[i].raw_filter_q3 >> 3;
+  return channel_state[i].raw_filter_q3 != 0 && max(filtered, measurement) - min(filtered, measurement) > RAW_SPIKE;
+}
+
+
+uint16_t filterMeasurement(uint8_t i, uint16_t measurement, boolean restart) {
+  // one EWMA step, the first reading and a confirmed step start over from the measurement
+  uint16_t& filter = channel_state[i].raw_filter_q3;
+  if (restart || filter == 0) {
+    filter = measurement << 3;
+  } else {
+    filter += ((int32_t)(measurement << 3) - filter) >> RAW_FILTER_SHIFT;
+  }
+  return (filter + 4) >> 3;
+}
+
+
+boolean setCalibration(ChannelState_T& channel, uint16_t wet, uint16_t dry) {
+  // wet and dry in 10 bit ADC counts. Returns false and keeps the old calibration for implausible values.
+  if (dry > 1023 || wet > dry || dry - wet < MIN_CALIBRATION_SPAN) {
+    return false;
+  }
+  const uint16_t span = (dry - wet)*RAW_SCALE; // raw counts between 0% and 100%
+  channel.calibration_dry     = dry*RAW_SCALE;
+  channel.percent_per_raw_q16 = ((100UL << 16) + span/2) / span;
+  return true;
+}
+
+
+uint8_t calibrationCheck(const CalibrationRecord_T& record) {
+  return CALIBRATION_MAGIC ^ (record.wet & 0xFF) ^ (record.wet >> 8) ^ (record.dry & 0xFF) ^ (record.dry >> 8);
+}
+
+
+void loadCalibration() {
+  for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
+    setCalibration(channel_state[i], WET_MEASUREMENT, DRY_MEASUREMENT);
+    CalibrationRecord_T record;
+    EEPROM.get(EEPROM_CALIBRATION_ADDR + i*sizeof(CalibrationRecord_T), record);
+    if (record.check == calibrationCheck(record)) {
+      setCalibration(channel_state[i], record.wet, record.dry); // an erased EEPROM (0xFF) fails the plausibility check
+    }
+#ifdef DEBUG
+    Serial.print(F("Channel "));
+    Serial.print(i+1);
+    Serial.print(F(" calibration dry raw: "));
+    Serial.print(channel_state[i].calibration_dry);
+    Serial.print(F(" slope q16: "));
+    Serial.println(channel_state[i].percent_per_raw_q16);
+#endif
+  }
+}
+
+
+boolean storeCalibration(uint8_t i, uint16_t wet, uint16_t dry) {
+  // applies and stores the calibration of channel i, false if it's implausible
+  if (!setCalibration(channel_state[i], wet, dry)) {
+    return false;
+  }
+  CalibrationRecord_T record;
+  record.wet = wet;
+  record.dry = dry;
+  record.check = calibrationCheck(record);
+  EEPROM.put(EEPROM_CALIBRATION_ADDR + i*sizeof(CalibrationRecord_T), record);
+  return true;
+}
+
+
+boolean setSettings(uint8_t i, const ChannelSettings_T& settings) {
+  // false and the old settings are kept for values out of range
+  if (settings.pump_duration == 0 || settings.max_pump_attempts > 7 || // pump_attempts is a 3 bit field
+      settings.pump_budget < settings.pump_duration || settings.pump_budget > PUMP_BUDGET_MAX) {
+    return false;
+  }
+  channel_settings[i] = settings;
+  return true;
+}
+
+
+uint8_t settingsCheck(const SettingsRecord_T& record) {
+  return SETTINGS_MAGIC ^ record.settings.pump_duration ^ record.settings.max_pump_attempts ^
+         (uint8_t)record.settings.pump_budget ^ (uint8_t)(record.settings.pump_budget >> 8);
+}
+
+
+void loadSettings() {
+  for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
+    channel_settings[i].pump_duration     = pgm_read_byte(&channel_config[i].pump_duration);
+    channel_settings[i].max_pump_attempts = pgm_read_byte(&channel_config[i].max_pump_attempts);
+    channel_settings[i].pump_budget       = pgm_read_word(&channel_config[i].pump_budget);
+    SettingsRecord_T record;
+    EEPROM.get(EEPROM_SETTINGS_ADDR + i*sizeof(SettingsRecord_T), record);
+    if (record.check == settingsCheck(record)) {
+      setSettings(i, record.settings);
+    }
+  }
+}
+
+
+boolean storeSettings(uint8_t i, const ChannelSettings_T& settings) {
+  if (!setSettings(i, settings)) {
+    return false;
+  }
+  SettingsRecord_T record;
+  record.settings = settings;
+  record.check = settingsCheck(record);
+  EEPROM.put(EEPROM_SETTINGS_ADDR + i*sizeof(SettingsRecord_T), record);
+  return true;
+}
+
+
+uint8_t doseCheck(const DoseRecord_T& record) {
+  uint8_t check = DOSE_MAGIC;
+  for (uint8_t b = 0; b < (const uint8_t*)&record.check - (const uint8_t*)&record; b++) {
+    check ^= ((const uint8_t*)&record)[b];
+  }
+  return check;
+}
+
+
+void loadDoses() {
+  for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
+    EEPROM.get(EEPROM_DOSE_ADDR + i*sizeof(DoseRecord_T), doses[i]);
+    if (doses[i].check != doseCheck(doses[i])) {
+      memset(&doses[i], 0, sizeof(doses[i]));
+    }
+  }
+}
+
+
+void storeDose(uint8_t i) {
+  // EEPROM.put() only writes the bytes that changed
+  doses[i].check = doseCheck(doses[i]);
+  EEPROM.put(EEPROM_DOSE_ADDR + i*sizeof(DoseRecord_T), doses[i]);
+}
+
+
+void drainBudgets() {
+  const uint32_t now = nowMs();
+  const uint16_t seconds = min((now - budget_ms)/1000, 0xFFFF);
+  budget_ms += (uint32_t)seconds*1000;
+  for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
+    const uint32_t drain = budget_rest[i] + (uint32_t)channelConfig(i).pump_budget*seconds;
+    budget_rest[i] = drain % BUDGET_DRAIN_DIVISOR;
+    doses[i].bucket_q4 -= min(doses[i].bucket_q4, drain/BUDGET_DRAIN_DIVISOR);
+  }
+}
+
+
+uint16_t budgetLeft(uint8_t i) {
+  // pump seconds the channel may still use now
+  const uint16_t budget_q4 = channelConfig(i).pump_budget*16;
+  return doses[i].bucket_q4 < budget_q4 ? (budget_q4 - doses[i].bucket_q4)/16 : 0;
+}
+
+
+void showMessage(const __FlashStringHelper* message, const char* details = NULL) {
+#ifdef HEADLESS
+#ifdef DEBUG
+  Serial.print(message);
+  Serial.println(details);
+#endif
+  (void)message;
+  (void)details;
+#else
+  const uint32_t powered = nowMs();
+  halDisplayMessage(message, details);
+  bookCharge(LOAD_DISPLAY, nowMs() - powered);
+#endif
+}
+
+
+void waitForButtonPress() {
+  while (halButtonPressed()) { halDelay(20); } // the press that started the calibration is still held
+  while (!halButtonPressed()) { halDelay(20); }
+  halDelay(50); // debounce
+  while (halButtonPressed()) { halDelay(20); }
+}
+
+
+void runCalibration() {
+  // One pass for all channels: the button is held at power up with all sensors in dry air,
+  // then the sensors are put into water and the button is pressed again.
+  uint16_t dry[NUMBER_OF_CHANNELS];
+  uint16_t measurement, measurement_ref;
+  for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
+    readChannel(i, measurement, measurement_ref);
+    dry[i] = (measurement + RAW_SCALE/2) / RAW_SCALE;
+  }
+  showMessage(F("Calibration\n\nPut sensors\ninto water\nand press\nthe button"));
+  waitForButtonPress();
+  uint8_t stored = 0;
+  for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
+    readChannel(i, measurement, measurement_ref);
+    const uint16_t wet = (measurement + RAW_SCALE/2) / RAW_SCALE;
+    if (storeCalibration(i, wet, dry[i])) {
+      stored |= 1 << i;
+    }
+#ifdef DEBUG
+    Serial.print(F("Channel "));
+    Serial.print(i+1);
+    Serial.print(F(" calibration wet: "));
+    Serial.print(wet);
+    Serial.print(F(" dry: "));
+    Serial.println(dry[i]);
+#endif
+  }
+  // one line per channel, '+' stored, '-' old calibration kept
+  char result[4*NUMBER_OF_CHANNELS];
+  char* line = result;
+  for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
+    *line++ = '1' + i;
+    *line++ = ' ';
+    *line++ = (stored & (1 << i)) ? '+' : '-';
+    *line++ = '\n';
+  }
+  *(line - 1) = '\0';
+  showMessage(F("Calibration\ndone\n"), result);
+}
+
+
+uint16_t historyPageAddr(uint8_t index) {
+  return EEPROM_HISTORY_ADDR + index*HISTORY_PAGE_SIZE;
+}
+
+
+void historyPutBits(uint8_t value, uint8_t bits) {
+  while (bits--) {
+    uint8_t mask = 0x80 >> (history.bit_pos & 0x07);
+    if ((value >> bits) & 0x01) {
+      history.page[history.bit_pos >> 3] |= mask;
+    } else {
+      history.page[history.bit_pos >> 3] &= ~mask;
+    }
+    history.bit_pos++;
+  }
+}
+
+
+uint8_t historyGetBits(uint16_t& pos, uint8_t bits) {
+  uint8_t value = 0;
+  while (bits--) {
+    value = (value << 1) | ((history.page[pos >> 3] >> (7 - (pos & 0x07))) & 0x01);
+    pos++;
+  }
+  return value;
+}
+
+
+boolean historyFits(uint8_t bits) {
+  return history.bit_pos + bits <= HISTORY_PAGE_SIZE*8;
+}
+
+
+void historyFlush(uint16_t from_bit) {
+  // EEPROM.update only writes bytes that changed
+  for (uint8_t b = from_bit >> 3; b < (history.bit_pos + 7) >> 3; b++) {
+    EEPROM.update(historyPageAddr(history.page_index) + b, history.page[b]);
+  }
+}
+
+
+void historyWriteSync(uint8_t minutes) {
+  historyPutBits(HISTORY_SYNC, 3);
+  historyPutBits(minutes, 7);
+  for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
+    historyPutBits(history.level[i], 7);
+  }
+}
+
+
+void historyStartPage(uint8_t minutes) {
+  // the new page begins with a sync of the current base levels
+  uint8_t seq = EEPROM.read(historyPageAddr(history.page_index));
+  seq = (seq == HISTORY_SEQ_ERASED) ? 0 : (seq + 1) % HISTORY_SEQ_ERASED;
+  history.page_index = (history.page_index + 1) % HISTORY_PAGES;
+  memset(history.page, 0xFF, HISTORY_PAGE_SIZE);
+  history.page[0] = seq;
+  history.bit_pos = 8;
+  historyWriteSync(minutes);
+  // the sequence number goes last, a page that was cut off by a reset stays invisible
+  for (uint8_t b = 1; b < HISTORY_PAGE_SIZE; b++) {
+    EEPROM.update(historyPageAddr(history.page_index) + b, history.page[b]);
+  }
+  EEPROM.update(historyPageAddr(history.page_index), seq);
+}
+
+
+void historyLogSync(uint8_t minutes) {
+  if (!historyFits(HISTORY_SYNC_BITS)) {
+    historyStartPage(minutes);
+    return;
+  }
+  uint16_t from = history.bit_pos;
+  historyWriteSync(minutes);
+  historyFlush(from);
+}
+
+
+void historyLogEvent(uint8_t type, uint8_t channel, uint8_t value, uint8_t value_bits) {
+  if (!historyFits(6 + value_bits)) {
+    historyStartPage(0);
+  }
+  uint16_t from = history.bit_pos;
+  historyPutBits(type, 3);
+  historyPutBits(channel, 3);
+  historyPutBits(value, value_bits);
+  historyFlush(from);
+}
+
+
+void historyLogPump(uint8_t channel, uint8_t seconds) {
+  historyLogEvent(HISTORY_PUMP, channel, seconds, 8);
+}
+
+
+void historyLogReference(uint8_t channel, uint8_t level) {
+  historyLogEvent(HISTORY_REFERENCE, channel, level, 7);
+}
+
+
+void historyLogSample(uint8_t minutes) {
+  history.minutes += minutes;
+  uint8_t changed = 0;
+  uint8_t bits = 1 + 7 + NUMBER_OF_CHANNELS;
+  boolean jump = false;
+  int8_t delta[NUMBER_OF_CHANNELS];
+  for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
+    delta[i] = channel_state[i].moisture_level - history.level[i];
+    if (delta[i] != 0) {
+      changed |= 1 << i;
+      bits += 4;
+      jump |= delta[i] < -8 || delta[i] > 7;
+    }
+    history.level[i] = channel_state[i].moisture_level;
+  }
+  if (!changed && history.minutes < HISTORY_HEARTBEAT_MINUTES) {
+    return; // keep counting, nothing worth a record
+  }
+  if (jump) {
+    historyLogSync(history.minutes);
+  } else if (!historyFits(bits)) {
+    historyStartPage(history.minutes); // the sync on the new page carries the sample
+  } else {
+    uint16_t from = history.bit_pos;
+    historyPutBits(0, 1);
+    historyPutBits(history.minutes, 7);
+    historyPutBits(changed, NUMBER_OF_CHANNELS);
+    for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
+      if (changed & (1 << i)) {
+        historyPutBits(delta[i] & 0x0F, 4);
+      }
+    }
+    historyFlush(from);
+  }
+  history.minutes = 0;
+}
+
+
+void historyBegin() {
+  // The newest page is the one whose successor doesn't carry the next sequence number.
+  // Its records are replayed to find the write position and the base levels.
+  uint8_t newest = HISTORY_PAGES;
+  for (uint8_t p = 0; p < HISTORY_PAGES && newest == HISTORY_PAGES; p++) {
+    uint8_t seq = EEPROM.read(historyPageAddr(p));
+    uint8_t next_seq = EEPROM.read(historyPageAddr((p + 1) % HISTORY_PAGES));
+    if (seq != HISTORY_SEQ_ERASED && next_seq != (seq + 1) % HISTORY_SEQ_ERASED) {
+      newest = p;
+    }
+  }
+  for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
+    history.level[i] = channel_state[i].moisture_level;
+  }
+  history.minutes = 0;
+  if (newest == HISTORY_PAGES) {
+    history.page_index = HISTORY_PAGES - 1; // empty log, start on page 0
+    historyStartPage(0);
+    return;
+  }
+  history.page_index = newest;
+  for (uint8_t b = 0; b < HISTORY_PAGE_SIZE; b++) {
+    history.page[b] = EEPROM.read(historyPageAddr(newest) + b);
+  }
+  uint16_t pos = 8;
+  while (pos + 3 <= HISTORY_PAGE_SIZE*8) {
+    uint16_t record = pos;
+    uint8_t type = historyGetBits(pos, 1) ? 0x4 | historyGetBits(pos, 2) : 0;
+    uint8_t changed;
+    switch (type) {
+      case 0:
+        pos += 7;
+        changed = historyGetBits(pos, NUMBER_OF_CHANNELS);
+        for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
+          if (changed & (1 << i)) {
+            history.level[i] += (int8_t)(historyGetBits(pos, 4) ^ 0x08) - 8; // sign extend
+          }
+        }
+        break;
+      case HISTORY_PUMP:      pos += 3 + 8; break;
+      case HISTORY_REFERENCE: pos += 3 + 7; break;
+      case HISTORY_SYNC:
+        pos += 7;
+        for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
+          history.level[i] = historyGetBits(pos, 7);
+        }
+        break;
+      default: // HISTORY_END
+        break;
+    }
+    if (type == HISTORY_END || pos > HISTORY_PAGE_SIZE*8) {
+      pos = record; // a truncated record counts as end
+      break;
+    }
+  }
+  history.bit_pos = pos;
+}
+
+
+void recordDrying() {
+  // one step of the drying rate estimate per cycle, a cycle after an unmeasured pump run or a fault only sets the new baseline
+  const uint32_t now = nowMs();
+  const uint16_t seconds = min((now - drying_ms)/1000, 0xFFFF);
+  drying_ms = now;
+  for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
+    Drying_T& d = drying[i];
+    if (health[i].fault != FAULT_NONE) {
+      // the level is stale, the first usable reading after the fault only sets the baseline
+      d.cycles = 0;
+      d.baseline = DRYING_NO_BASELINE;
+      continue;
+    }
+    if (d.baseline != DRYING_NO_BASELINE) {
+      const int16_t drop = ((int16_t)d.baseline - d.level)*256;
+      if (drop < -DRYING_RISE_RESET*256) {
+        d.cycles = 0;
+      } else if (d.cycles == 0) {
+        d.drop_q8 = drop;
+        d.seconds = seconds;
+        d.cycles = 1;
+      } else {
+        d.drop_q8 += ((int32_t)drop - d.drop_q8) >> DRYING_WEIGHT_SHIFT;
+        d.seconds += ((int32_t)seconds - d.seconds) >> DRYING_WEIGHT_SHIFT;
+        d.cycles = min(d.cycles + 1, DRYING_MIN_CYCLES);
+      }
+    }
+    d.baseline = d.level;
+  }
+}
+
+
+uint16_t minutesToReference(uint8_t i) {
+  // predicted time until channel i dries down to its reference level,
+  // DRYING_NO_PREDICTION while the estimate is too young or the channel doesn't dry
+  const Drying_T& d = drying[i];
+  const uint8_t reference = channel_state[i].moisture_reference_level;
+  if (d.cycles < DRYING_MIN_CYCLES || d.drop_q8 <= 0 || health[i].fault != FAULT_NONE) {
+    return DRYING_NO_PREDICTION;
+  }
+  if (d.level <= reference) {
+    return 0;
+  }
+  return min((uint32_t)(d.level - reference)*256*d.seconds/d.drop_q8/60, DRYING_NO_PREDICTION - 1);
+}
 
-// 1.54" Monochrome displays with 200x200 pixels and SSD1681 chipset
-ThinkInk_154_Tricolor_Z90 display(EPD_DC, EPD_RESET, EPD_CS, SRAM_CS, EPD_BUSY);
 
-// Global state
-struct ChannelState_T {
-  const uint8_t pump_duration;
-  const uint8_t max_pump_attempts;
-  uint8_t pump_attempts;
-  uint16_t moisture_level;
-  uint16_t moisture_level_raw;
-  uint16_t moisture_reference_level;
-  const uint8_t sensor_analog_pin;
-  const uint8_t sensor_dec;
-  const uint8_t pump_dec;
-} channel_state[NUMBER_OF_CHANNELS] = {
-  // init values
-  {PUMP0_DURATION, PUMP0_MAX_ATTEMPTS, 0, 99, 0, 25, A0, 4, 0}, // Channel 0
-  {PUMP1_DURATION, PUMP1_MAX_ATTEMPTS, 0, 99, 0, 25, A1, 5, 1}, // Channel 1
-  {PUMP2_DURATION, PUMP2_MAX_ATTEMPTS, 0, 99, 0, 25, A2, 6, 2}, // Channel 2
-  {PUMP3_DURATION, PUMP3_MAX_ATTEMPTS, 0, 99, 0, 25, A3, 7, 3}  // Channel 3
-};
+boolean needsWater(uint8_t i) {
+  if (health[i].fault != FAULT_NONE) {
+    return false;
+  }
+  if (channel_state[i].moisture_level < channel_state[i].moisture_reference_level) {
+    return true;
+  }
+#ifdef PREDICTIVE_WATERING
+  return minutesToReference(i) < PREDICT_LEAD_MINUTES;
+#else
+  return false;
+#endif
+}
 
-///////////////////////////////////////////////////////////////////////////////
-// code section below
-/////////////////////
 
-void setup() {
-#ifdef DEBUG
-  Serial.begin(9600);
-  while (!Serial) { delay(10); }
-#endif
-  display.begin(THINKINK_TRICOLOR);
-  // display.setRotation(1); // experiment with this depending on how the board is installed. Values can be 0, 1, 2, 3
-  CLKPR = 0x80;
-  CLKPR = clk_div;
+void measureSupply() {
+  // resting VCC with all decoder outputs off, sets the shedding level
+  const uint16_t shed_mv[] = {VCC_LOW_MV, VCC_SHED_PUMP_MV, VCC_SHED_SLEEP_MV};
+  supply.millivolts = halSupplyMillivolts();
+  uint8_t level = SHED_NONE;
+  for (uint8_t l = 0; l < sizeof(shed_mv)/sizeof(shed_mv[0]); l++) {
+    const uint16_t threshold = shed_mv[l] + (supply.shed_level > l ? VCC_HYSTERESIS_MV : 0);
+    if (supply.millivolts < threshold) {
+      level = l + 1;
+    }
+  }
+  if (supply.pump_lock_mv != 0) {
+    if (supply.millivolts < supply.pump_lock_mv) {
+      level = SHED_PUMPS_OFF;
+    } else {
+      supply.pump_lock_mv = 0; // recovered or a fresh battery
+    }
+  }
+  supply.shed_level = level;
 #ifdef DEBUG
-  Serial.print("Soil Moisture Guard ");
-  Serial.println(VERSION);
-  Serial.print("Clock divisor ");
-  Serial.println(clk_scaler);
+  Serial.print(F("Supply mV: "));
+  Serial.print(supply.millivolts);
+  Serial.print(F(" shedding level: "));
+  Serial.println(supply.shed_level);
 #endif
-  pinMode(DISP_ENA, OUTPUT);
-  pinMode(DEC_EN, OUTPUT);
-  pinMode(2, OUTPUT); pinMode(3, OUTPUT); pinMode(4, OUTPUT);
 }
 
 
-uint8_t convertMeasurementToPercent(uint16_t measurement) {
-  // saturates at 0 or 99%
-  const float a = 100.0/(WET_MEASUREMENT - DRY_MEASUREMENT); // coefficient for 100%
-  const float b = -DRY_MEASUREMENT*a;
-  float percentage = measurement*a + b;
-  return (uint8_t)max(0, min(99, percentage));
+#ifdef TELEMETRY
+void telemetryPump(uint8_t channel, uint8_t seconds) {
+  telemetry.sample[telemetry.samples].pump_seconds[channel] = seconds;
 }
+#endif
 
 
-void setDecoder(uint8_t val) {
-  digitalWrite(DEC_EN, LOW);
-  uint8_t d4_lvl = (val>>2) & 0x01;
-  uint8_t d3_lvl = (val>>1) & 0x01;
-  uint8_t d2_lvl = val & 0x01;
-#ifdef DEBUG
-  Serial.print("setDecoder to ");
-  Serial.print(val);
-  Serial.print(" d4,d3,d2 = ");
-  Serial.print(d4_lvl);
-  Serial.print(d3_lvl);
-  Serial.println(d2_lvl);
+void telemetryEndCycle() {
+  // closes the sample of this cycle and starts sending the batch when it's full
+#ifdef TELEMETRY
+  TelemetrySample_T& sample = telemetry.sample[telemetry.samples];
+  sample.minutes = sleep_minutes;
+  sample.supply = min((max(supply.millivolts, 2000) - 2000)/20, 255);
+  for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
+    sample.moisture_level[i] = channel_state[i].moisture_level;
+  }
+  if (++telemetry.samples < TELEMETRY_BATCH) {
+    return;
+  }
+  telemetry.node = TELEMETRY_NODE_ID;
+  for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
+    telemetry.moisture_reference_level[i] = channel_state[i].moisture_reference_level;
+    telemetry.pump_attempts[i] = channel_state[i].pump_attempts;
+    telemetry.fault[i] = health[i].fault;
+    telemetry.pump_budget_used[i] = min((uint32_t)doses[i].bucket_q4*100/16/channelConfig(i).pump_budget, 255);
+  }
+  taskStart(TASK_TELEMETRY);
+#endif
+}
+
+
+#ifdef TELEMETRY
+void stepTelemetry(uint8_t state) {
+  // No retries, the history log in EEPROM has it all. The batch is done long before the next cycle adds to it.
+  if (state == TELEMETRY_SEND) {
+    telemetry_start_ms = nowMs();
+    if (halRadioStart((const uint8_t*)&telemetry, sizeof(telemetry))) {
+      taskWait(TASK_TELEMETRY, TELEMETRY_WAIT, TELEMETRY_POLL_MS);
+      return;
+    }
+  } else if (!halRadioSent() && nowMs() - telemetry_start_ms < TELEMETRY_TIMEOUT_MS) {
+    taskWait(TASK_TELEMETRY, TELEMETRY_WAIT, TELEMETRY_POLL_MS);
+    return;
+  }
+  halRadioSleep();
+  bookCharge(LOAD_RADIO, nowMs() - telemetry_start_ms);
+  telemetry.seq++;
+  telemetry.samples = 0;
+  memset(telemetry.sample, 0, sizeof(telemetry.sample));
+  taskEnd(TASK_TELEMETRY);
+}
 #endif
-  // HC237 wiring: A0 - d2, A1 - d3, A2 - d4
-  digitalWrite(2, d2_lvl); // this can probably be done in one cycle by writing the appropriate register directly. But we're in no hurry and can use the Arduino API for readability.
-  digitalWrite(3, d3_lvl);
-  digitalWrite(4, d4_lvl);
-  digitalWrite(DEC_EN, HIGH);
+
+
+#ifdef SERIAL_PROTOCOL
+uint8_t* putWord(uint8_t* p, uint16_t value) {
+  *p++ = value & 0xFF;
+  *p++ = value >> 8;
+  return p;
+}
+
+
+int16_t protocolReadByte(uint16_t timeout_ms) {
+  const uint32_t start = halMillis();
+  do {
+    const int16_t c = halSerialRead();
+    if (c >= 0) {
+      return c;
+    }
+  } while (halMillis() - start < timeout_ms);
+  return -1;
+}
+
+
+boolean protocolReadFrame(uint8_t* frame) {
+  // type, length and payload of the frame after the sync byte, false for a bad frame
+  uint16_t crc = 0;
+  for (uint8_t n = 0; n < 2 || n < 2 + frame[1]; n++) {
+    const int16_t c = protocolReadByte(PROTOCOL_BYTE_MS);
+    if (c < 0 || (n == 1 && c > PROTOCOL_MAX_PAYLOAD)) {
+      return false;
+    }
+    frame[n] = c;
+    crc = _crc_xmodem_update(crc, c);
+  }
+  const int16_t crc_high = protocolReadByte(PROTOCOL_BYTE_MS);
+  const int16_t crc_low  = protocolReadByte(PROTOCOL_BYTE_MS);
+  return crc_high >= 0 && crc_low >= 0 && crc == (uint16_t)((crc_high << 8) | crc_low);
+}
+
+
+void protocolSend(uint8_t type, const uint8_t* payload, uint8_t length) {
+  const uint8_t header[] = {PROTOCOL_SYNC, type, length};
+  uint16_t crc = _crc_xmodem_update(_crc_xmodem_update(0, type), length);
+  for (uint8_t n = 0; n < length; n++) {
+    crc = _crc_xmodem_update(crc, payload[n]);
+  }
+  const uint8_t trailer[] = {(uint8_t)(crc >> 8), (uint8_t)(crc & 0xFF)};
+  halSerialWrite(header, sizeof(header));
+  halSerialWrite(payload, length);
+  halSerialWrite(trailer, sizeof(trailer));
+}
+
+
+uint8_t protocolHandle(uint8_t type, uint8_t* payload, uint8_t length) {
+  // answers one request, the response is built in payload. Returns its length, 0 for an unknown request.
+  uint8_t* p = payload;
+  const uint8_t i = payload[0]; // channel or page of the requests that have one
+  switch (type) {
+  case PROTOCOL_INFO:
+    *p++ = NUMBER_OF_CHANNELS;
+    *p++ = HISTORY_PAGES;
+    *p++ = history.page_index;
+    *p++ = HISTORY_PAGE_SIZE;
+    memcpy_P(p, PSTR(VERSION), sizeof(VERSION) - 1);
+    p += sizeof(VERSION) - 1;
+    return p - payload;
+  case PROTOCOL_STATE:
+    p = putWord(p, supply.millivolts);
+    *p++ = sleep_minutes;
+    *p++ = supply.shed_level;
+    for (uint8_t c = 0; c < NUMBER_OF_CHANNELS; c++) {
+      *p++ = channel_state[c].moisture_level;
+      *p++ = channel_state[c].moisture_reference_level;
+      p = putWord(p, channel_state[c].moisture_level_raw);
+      *p++ = channel_state[c].pump_attempts;
+      p = putWord(p, minutesToReference(c));
+      *p++ = health[c].fault;
+    }
+    return p - payload;
+  case PROTOCOL_STATS:
+    memcpy(payload, &stats, sizeof(stats));
+    return sizeof(stats);
+  case PROTOCOL_HISTORY:
+    if (length != 1 || i >= HISTORY_PAGES) {
+      break;
+    }
+    *p++ = i;
+    for (uint8_t b = 0; b < HISTORY_PAGE_SIZE; b++) {
+      *p++ = EEPROM.read(historyPageAddr(i) + b); // the page being written is flushed after every record
+    }
+    return p - payload;
+  case PROTOCOL_CONFIG:
+    for (uint8_t c = 0; c < NUMBER_OF_CHANNELS; c++) {
+      CalibrationRecord_T record;
+      EEPROM.get(EEPROM_CALIBRATION_ADDR + c*sizeof(CalibrationRecord_T), record);
+      if (record.check != calibrationCheck(record)) {
+        record.wet = WET_MEASUREMENT;
+        record.dry = DRY_MEASUREMENT;
+      }
+      *p++ = channel_settings[c].pump_duration;
+      *p++ = channel_settings[c].max_pump_attempts;
+      p = putWord(p, record.wet);
+      p = putWord(p, record.dry);
+      p = putWord(p, channel_settings[c].pump_budget);
+    }
+    return p - payload;
+  case PROTOCOL_SET_CHANNEL:
+    if (length != 5 || i >= NUMBER_OF_CHANNELS) {
+      break;
+    }
+    payload[0] = storeSettings(i, {payload[1], payload[2], (uint16_t)(payload[3] | (payload[4] << 8))}) ? PROTOCOL_OK : PROTOCOL_REJECTED;
+    return 1;
+  case PROTOCOL_SET_CALIBRATION:
+    if (length != 5 || i >= NUMBER_OF_CHANNELS) {
+      break;
+    }
+    payload[0] = storeCalibration(i, payload[1] | (payload[2] << 8), payload[3] | (payload[4] << 8)) ? PROTOCOL_OK : PROTOCOL_REJECTED;
+    return 1;
+  case PROTOCOL_DOSES:
+    for (uint8_t c = 0; c < NUMBER_OF_CHANNELS; c++) {
+      p = putWord(p, doses[c].pump_seconds);
+      p = putWord(p, doses[c].pump_seconds >> 16);
+      p = putWord(p, doses[c].doses);
+      p = putWord(p, doses[c].bucket_q4/16);
+    }
+    return p - payload;
+  }
+  return 0;
+}
+
+
+boolean serveSerial(uint16_t listen_ms) {
+  // Answers requests until there was none for listen_ms. Returns false if no valid
+  // frame came in, noise on RX alone mustn't keep the board awake. The scheduler books the awake time.
+  uint32_t last_request = halMillis();
+  boolean served = false;
+  uint8_t frame[2 + PROTOCOL_MAX_PAYLOAD]; // type, length, payload
+  while (halMillis() - last_request < listen_ms) {
+    if (protocolReadByte(listen_ms) != PROTOCOL_SYNC) {
+      continue; // the wake up byte, noise or a timeout
+    }
+    if (!protocolReadFrame(frame)) {
+      frame[2] = PROTOCOL_BAD_FRAME;
+      protocolSend(PROTOCOL_ERROR, &frame[2], 1);
+      continue;
+    }
+    const uint8_t length = protocolHandle(frame[0], &frame[2], frame[1]);
+    if (length == 0) {
+      frame[2] = PROTOCOL_UNKNOWN;
+      protocolSend(PROTOCOL_ERROR, &frame[2], 1);
+    } else {
+      protocolSend(frame[0] | PROTOCOL_RESPONSE, &frame[2], length);
+    }
+    last_request = halMillis();
+    served = true;
+  }
+  return served;
 }
+#endif
 
 
 boolean almostEqual(uint8_t a, uint8_t b, uint8_t absdiff) {
@@ -149,172 +1497,751 @@ boolean almostEqual(uint8_t a, uint8_t b, uint8_t absdiff) {
 }
 
 
-boolean updateState() {
-  // get all measurements, return true if there was an update
-  boolean update = false;
-  for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
-    setDecoder(channel_state[i].sensor_dec); // power up the sensor and potentiometer
+void updateChannel(uint8_t i, uint16_t measurement, uint16_t measurement_ref) {
+  // measurement from the sensor, measurement_ref from the potentiometer (=reference)
+  uint8_t percentage     = convertMeasurementToPercent(measurement, channel_state[i]);
+  uint8_t percentage_ref = measurement_ref/10; // 0 - 1023 / 10 = 0 - 102%
+  // almostEqual allows some tolerance so we don't run pumps for single percentage point changes.
+  // Those could be noise. Try to be quiet as much as possible.
+  drying[i].level = percentage;
+  if (!almostEqual(channel_state[i].moisture_level, percentage, MOISTURE_HYSTERESIS)) {
+    channel_state[i].moisture_level = percentage;
+    channel_state[i].moisture_level_raw = measurement;
+  }
+  if (!almostEqual(channel_state[i].moisture_reference_level, percentage_ref, 2)) {
+    channel_state[i].moisture_reference_level = percentage_ref;
+    historyLogReference(i, percentage_ref);
+  }
+  if (channel_state[i].moisture_level >= channel_state[i].moisture_reference_level) {
+    channel_state[i].pump_attempts = 0;
+  }
 #ifdef DEBUG
-    Serial.print("Reading Channel");
-    Serial.println(i+1);
-#endif
-    delay(2000/clk_scaler);                  // wait until oscillator on sensor is steady
-    uint16_t measurement     = 0;            // for A/D reading from sensor
-    uint16_t measurement_ref = 0;            // for A/D reading from potentiometer (=reference)
-    for (uint8_t j = 0; j < NUMBER_OF_MEASUREMENT_SAMPLES; j++) {
-      measurement     += analogRead(channel_state[i].sensor_analog_pin);
-      measurement_ref += analogRead(MOIST_REF);
-    }
-    digitalWrite(DEC_EN, LOW); // sensor power down
-    measurement     /= NUMBER_OF_MEASUREMENT_SAMPLES; // average
-    measurement_ref /= NUMBER_OF_MEASUREMENT_SAMPLES; // the reference shouldn't be noisy so it's not really necessary to average it but .. do it anyway for .. reasons
-    uint8_t percentage     = convertMeasurementToPercent(measurement);
-    uint8_t percentage_ref = measurement_ref/10; // 0 - 1023 / 10 = 0 - 102%
-    // almostEqual allows some tolerance so we don't run pumps for single percentage point changes.
-    // Those could be noise. Try to be quiet as much as possible.
-    if (!almostEqual(channel_state[i].moisture_level, percentage, 2)) {
-      channel_state[i].moisture_level = percentage;
-      channel_state[i].moisture_level_raw = measurement;
-      update |= true;
-    }
-    if (!almostEqual(channel_state[i].moisture_reference_level, percentage_ref, 2)) {
-      channel_state[i].moisture_reference_level = percentage_ref;
-      update |= true;
-    }
-    if (channel_state[i].moisture_level >= channel_state[i].moisture_reference_level) {
-      channel_state[i].pump_attempts = 0;
-    } else {
-        update |= true; // always go through the update cycle when too dry (pump attempt + counting)
+  Serial.print(F("Channel "));
+  Serial.print(i+1);
+  Serial.print(F(" raw: "));
+  Serial.print(measurement);
+  Serial.print(F(" percent: "));
+  Serial.print(percentage);
+  Serial.print(F(" reference percent: "));
+  Serial.println(percentage_ref);
+#endif
+}
+
+
+void setFault(uint8_t i, uint8_t fault) {
+  if (health[i].fault == FAULT_NONE) {
+    health[i].recheck = FAULT_RECHECK_CYCLES;
+    drying[i].cycles = 0; // the estimate starts over once the channel is back
+    drying[i].baseline = DRYING_NO_BASELINE;
+  }
+  health[i].fault = fault;
+#ifdef DEBUG
+  Serial.print(F("Channel "));
+  Serial.print(i+1);
+  Serial.print(F(" fault "));
+  Serial.println(fault);
+#endif
+}
+
+
+uint8_t sensorFault(uint8_t i, uint16_t measurement) {
+  // classifies one unfiltered reading, FAULT_NONE if it's usable
+  ChannelHealth_T& h = health[i];
+  h.repeats = measurement == h.last_raw ? min(h.repeats + 1, FAULT_STUCK_CYCLES) : 0;
+  h.last_raw = measurement;
+  if (measurement < FAULT_RAW_MIN*RAW_SCALE || measurement > FAULT_RAW_MAX*RAW_SCALE) {
+    return FAULT_RANGE;
+  }
+  return h.repeats >= FAULT_STUCK_CYCLES - 1 ? FAULT_STUCK : FAULT_NONE;
+}
+
+
+uint8_t channelsToMeasure() {
+  // all channels without a fault and the faulted ones that are due for a recheck
+  uint8_t mask = 0;
+  for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
+    if (health[i].fault != FAULT_NONE && --health[i].recheck != 0) {
+      continue;
     }
+    health[i].recheck = FAULT_RECHECK_CYCLES;
+    mask |= 1 << i;
+  }
+  return mask;
+}
+
+
+void stepMeasure(uint8_t state) {
+  // The HC237 only drives one output at a time so sensors can't be powered up
+  // in parallel, the MCU sleeps while a sensor settles.
+  if (state == MEASURE_SAMPLE) {
+    const uint8_t c = measuring.channel;
+    uint16_t measurement, measurement_ref;
+    sampleChannel(c, measurement, measurement_ref);
+    boolean restart = measuring.restart & (1 << c);
+    if (!restart && isSpike(c, measurement)) {
+      // the sensor is still powered and settled, so a second look only costs the conversions.
+      // If it's off as well the soil really changed, like watering by hand.
+      sampleChannel(c, measurement, measurement_ref);
+      restart = isSpike(c, measurement);
 #ifdef DEBUG
-    Serial.print("Channel ");
-    Serial.print(i+1);
-    Serial.print(" raw: ");
-    Serial.print(measurement);
-    Serial.print(" percent: ");
-    Serial.print(percentage);
-    Serial.print(" reference percent: ");
-    Serial.println(percentage_ref);
+      Serial.print(F("Channel "));
+      Serial.print(c+1);
+      Serial.println(restart ? F(" stepped") : F(" spike rejected"));
 #endif
+    }
+    channelOff(measuring.powered_ms);
+    const uint8_t fault = sensorFault(c, measurement);
+    if (fault != FAULT_NONE) {
+      setFault(c, fault); // the level stays at the last usable reading
+    } else {
+      // the filter doesn't know how long a faulted channel wasn't measured
+      updateChannel(c, filterMeasurement(c, measurement, restart || health[c].fault != FAULT_NONE), measurement_ref);
+      if (health[c].fault != FAULT_NONE) {
+        // the attempts start over, after a pump fault with a single one to probe the pump
+        health[c].pumped_from = channel_state[c].moisture_level;
+        channel_state[c].pump_attempts = health[c].fault == FAULT_NO_WATER ? max(channelConfig(c).max_pump_attempts, 1) - 1 : 0;
+        health[c].fault = FAULT_NONE;
+      }
+    }
+    measuring.mask &= ~(1 << c);
+  }
+  if (measuring.mask == 0) {
+    taskEnd(TASK_MEASURE);
+    return;
   }
-  return update;
+  measuring.channel = 0;
+  while (!(measuring.mask & (1 << measuring.channel))) {
+    measuring.channel++;
+  }
+  measuring.powered_ms = nowMs();
+  powerChannel(measuring.channel);
+  taskWait(TASK_MEASURE, MEASURE_SAMPLE, SENSOR_SETTLE_MS);
 }
 
 
-void updateDisplay() {
-  digitalWrite(DISP_ENA, HIGH);
-  display.powerUp();
-  display.clearBuffer();
-  // the display is divided into 4 columns: (1) channel number, (2) moisture level graph, (3) moisture level numeric, (4) pump attempts
-  const uint8_t channel_number_x_offset =   0;                 // (1)
-  const uint8_t moist_lvl_bar_x_offset  =  12;                 // (2)
-  const uint8_t moist_lvl_txt_x_offset  = 150;                 // (3)
-  const uint8_t pump_attempts_x_offset  = display.width() - 6; // (4)
+#ifndef HEADLESS
+uint8_t dirtyChannels() {
+  // bit i is set when channel i looks different from what's on the display
+  uint8_t dirty = 0;
+  for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
+    if (!display_valid ||
+        displayed_state[i].moisture_level           != channel_state[i].moisture_level ||
+        displayed_state[i].moisture_reference_level != channel_state[i].moisture_reference_level ||
+        displayed_state[i].moisture_level_raw       != channel_state[i].moisture_level_raw ||
+        displayed_state[i].pump_attempts            != channel_state[i].pump_attempts ||
+        displayed_state[i].over_budget              != (budgetLeft(i) == 0) ||
+        displayed_state[i].fault                    != health[i].fault) {
+      dirty |= 1 << i;
+    }
+  }
+  return dirty;
+}
+
+
+boolean displayDue(uint8_t dirty) {
+  // On a low battery the refreshes are rationed, a change of the shedding level is always shown
+  if (!display_valid || supply.shed_level != supply.displayed_level) {
+    return true;
+  }
+  if (supply.shed_level >= SHED_DISPLAY) {
+    return dirty && supply.minutes_since_refresh >= SHED_DISPLAY_MINUTES;
+  }
+  return dirty;
+}
+
+
+void columnSpan(DisplayColumn_T& column, uint8_t y0, uint8_t y1, uint16_t color) {
+  // paints pixels y0..y1-1 of the column, the last color painted wins like with Adafruit_GFX
+  uint8_t* ink   = (color == EPD_RED) ? column.red : column.black;
+  uint8_t* other = (color == EPD_RED) ? column.black : column.red;
+  for (uint8_t y = y0; y < y1; ) {
+    if ((y & 0x07) == 0 && y + 8 <= y1) {
+      ink[y >> 3] = 0xFF;
+      other[y >> 3] = 0x00;
+      y += 8;
+    } else {
+      ink[y >> 3]   |= 0x80 >> (y & 0x07);
+      other[y >> 3] &= ~(0x80 >> (y & 0x07));
+      y++;
+    }
+  }
+}
+
+
+void textColumn(DisplayColumn_T& column, uint8_t x, uint8_t x0, uint8_t y0, const char* text, uint8_t size, uint16_t color) {
+  // the part of text at (x0, y0) that falls into column x, 6*size pixels per character
+  if (x < x0) {
+    return;
+  }
+  const uint8_t cx = x - x0;
+  const uint8_t index = cx/(6*size);
+  if (index >= strlen(text)) {
+    return;
+  }
+  const uint8_t gx = (cx % (6*size))/size;
+  const char* glyph = strchr_P(glyph_chars, text[index]);
+  if (gx >= 5 || glyph == NULL) {
+    return; // spacing between characters or no glyph
+  }
+  const uint8_t bits = pgm_read_byte(&glyphs[glyph - glyph_chars][gx]);
+  for (uint8_t gy = 0; gy < 8; gy++) {
+    if (bits & (1 << gy)) {
+      columnSpan(column, y0 + gy*size, y0 + (gy+1)*size, color);
+    }
+  }
+}
+
+
+void flashTextColumn(DisplayColumn_T& column, uint8_t x, uint8_t x0, uint8_t y0, const char* text, uint8_t size, uint16_t color) {
+  // textColumn() for a string in PROGMEM of up to 7 characters
+  if (x < x0) {
+    return;
+  }
+  char buffer[8];
+  strncpy_P(buffer, text, sizeof(buffer) - 1);
+  buffer[sizeof(buffer) - 1] = '\0';
+  textColumn(column, x, x0, y0, buffer, size, color);
+}
+
+
+void numberColumn(DisplayColumn_T& column, uint8_t x, uint8_t x0, uint8_t y0, uint16_t value, boolean percent, uint8_t size, uint16_t color) {
+  if (x < x0 || x >= x0 + 6*6*size) {
+    return; // skip the conversion for columns that can't show this number
+  }
+  char text[7];
+  utoa(value, text, 10);
+  if (percent) {
+    strcat_P(text, PSTR("%"));
+  }
+  textColumn(column, x, x0, y0, text, size, color);
+}
+
+
+void renderColumn(uint8_t x, DisplayColumn_T& column, const char* footer, const char* vcc) {
+  // the display has one row per channel and is divided into 4 columns: (1) channel number, (2) moisture level graph, (3) moisture level numeric, (4) pump attempts and budget
+  const uint8_t channel_number_x_offset =   0;                // (1)
+  const uint8_t moist_lvl_bar_x_offset  =  12;                // (2)
+  const uint8_t moist_lvl_txt_x_offset  = 150;                // (3)
+  const uint8_t pump_attempts_x_offset  = DISPLAY_SIZE - 6;   // (4)
+  memset(&column, 0, sizeof(column));
   for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
-    uint8_t y_offset = i*(display.height()/NUMBER_OF_CHANNELS);
-    display.setTextSize(2);
+    const uint8_t y_offset = i*row_height;
+    const uint16_t level_color = (channel_state[i].moisture_level < channel_state[i].moisture_reference_level) ? EPD_RED : EPD_BLACK;
     // channel numbers
-    display.setTextColor(EPD_BLACK);
-    display.setCursor(channel_number_x_offset, y_offset+15);
-    display.print(i+1);
-    // moisture levels
-    if (channel_state[i].moisture_level < channel_state[i].moisture_reference_level) {
-      display.setTextColor(EPD_RED);
+    numberColumn(column, x, channel_number_x_offset, y_offset+text_y_offset, i+1, false, text_size, EPD_BLACK);
+    // moisture levels, or the fault of a channel that isn't measured any more
+    const uint8_t fault = health[i].fault;
+    if (fault != FAULT_NONE) {
+      const char code[3] = {'!', (char)('0' + fault), '\0'};
+      textColumn(column, x, moist_lvl_txt_x_offset, y_offset+text_y_offset, code, text_size, EPD_RED);
     } else {
-      display.setTextColor(EPD_BLACK);
+      numberColumn(column, x, moist_lvl_txt_x_offset, y_offset+text_y_offset, channel_state[i].moisture_level, true, text_size, level_color);
     }
-    display.setCursor(moist_lvl_txt_x_offset, y_offset+15);
-    display.print(channel_state[i].moisture_level);
-    display.print("%");
     // raw value
-    display.setTextSize(1);
-    display.setTextColor(EPD_BLACK);
-    display.setCursor(moist_lvl_txt_x_offset, y_offset+35);
-    display.print(channel_state[i].moisture_level_raw);
+    if (text_size > 1) {
+      numberColumn(column, x, moist_lvl_txt_x_offset, y_offset+text_y_offset+20, channel_state[i].moisture_level_raw, false, 1, EPD_BLACK);
+    }
     // pump attempts
-    display.setTextSize(1);
-    if (channel_state[i].pump_attempts >= channel_state[i].max_pump_attempts) {
-      display.setTextColor(EPD_RED);
-    } else {
-      display.setTextColor(EPD_BLACK);
+    const uint16_t attempts_color = (channel_state[i].pump_attempts >= channelConfig(i).max_pump_attempts) ? EPD_RED : EPD_BLACK;
+    numberColumn(column, x, pump_attempts_x_offset, y_offset+text_y_offset+5*(text_size-1), channel_state[i].pump_attempts, false, 1, attempts_color);
+    // pump seconds in the budget, as of the refresh. Only going over the budget triggers one.
+    if (text_size > 1) {
+      const uint16_t budget_seconds = doses[i].bucket_q4/16;
+      const uint8_t digits = budget_seconds >= 1000 ? 4 : budget_seconds >= 100 ? 3 : budget_seconds >= 10 ? 2 : 1;
+      numberColumn(column, x, DISPLAY_SIZE - 6*digits, y_offset+text_y_offset+20, budget_seconds, false, 1, budgetLeft(i) == 0 ? EPD_RED : EPD_BLACK);
     }
-    display.setCursor(pump_attempts_x_offset, y_offset+20);
-    display.print(channel_state[i].pump_attempts);
     // moisture level as bar chart
-    uint16_t barColor = EPD_BLACK;
-    if (channel_state[i].moisture_level < channel_state[i].moisture_reference_level) {
-      barColor = EPD_RED;
-    }
-    uint8_t barLength = (uint8_t)(channel_state[i].moisture_level*BAR_SCALER);
-    display.fillRect(moist_lvl_bar_x_offset, y_offset+8, barLength, 34, barColor);
-    // reference markers
-    barLength = (uint8_t)(channel_state[i].moisture_reference_level*BAR_SCALER);
-    display.fillTriangle(moist_lvl_bar_x_offset + barLength - 3, y_offset+4,
-                         moist_lvl_bar_x_offset + barLength + 3, y_offset+4,
-                         moist_lvl_bar_x_offset + barLength    , y_offset+8,
-                         EPD_BLACK);
-    display.fillTriangle(moist_lvl_bar_x_offset + barLength    , y_offset+43,
-                         moist_lvl_bar_x_offset + barLength + 3, y_offset+47,
-                         moist_lvl_bar_x_offset + barLength - 3, y_offset+47,
-                         EPD_BLACK);
-    display.drawLine(moist_lvl_bar_x_offset + barLength, y_offset+8,
-                     moist_lvl_bar_x_offset + barLength, y_offset+43,
-                     EPD_BLACK);
-  }
-  // version in lower right corner
-  display.setTextColor(EPD_BLACK);
-  display.setCursor(display.width()-strlen(VERSION)*6, display.height()-8);
-  display.print(VERSION);
+    const uint8_t bar_top    = y_offset + bar_y_offset;
+    const uint8_t bar_bottom = bar_top + bar_height + 1;
+    if (fault == FAULT_NONE && x >= moist_lvl_bar_x_offset && x < moist_lvl_bar_x_offset + channel_state[i].moisture_level*BAR_LENGTH_100/100) {
+      columnSpan(column, bar_top, bar_top + bar_height, level_color);
+    }
+    // reference markers: triangles above and below the bar joined by a line
+    const uint8_t marker_x = moist_lvl_bar_x_offset + channel_state[i].moisture_reference_level*BAR_LENGTH_100/100;
+    const uint8_t dx = (x > marker_x) ? x - marker_x : marker_x - x;
+    if (dx <= 3) {
+      const uint8_t h = marker_height*(3 - dx)/3;
+      columnSpan(column, bar_top - marker_height, bar_top - marker_height + h + 1, EPD_BLACK);
+      columnSpan(column, bar_bottom + marker_height - h, bar_bottom + marker_height + 1, EPD_BLACK);
+    }
+    if (dx == 0) {
+      columnSpan(column, bar_top, bar_bottom + 1, EPD_BLACK);
+    }
+  }
+  // version in lower right corner, footer in lower left corner
+  flashTextColumn(column, x, DISPLAY_SIZE - (sizeof(VERSION) - 1)*6, footer_y, PSTR(VERSION), 1, EPD_BLACK);
+  textColumn(column, x, moist_lvl_bar_x_offset, footer_y, footer, 1, EPD_BLACK);
+  // supply voltage, red as low battery indicator
+  textColumn(column, x, moist_lvl_txt_x_offset - 6*6, footer_y, vcc, 1, supply.shed_level >= SHED_DISPLAY ? EPD_RED : EPD_BLACK);
+}
+
+
+void updateDisplay() {
+  // The SSD1681 tricolor panel has no partial update and the framebuffer in SRAM
+  // loses its content when DISP_ENA is switched off, so a refresh always redraws
+  // all channels. The cycle only refreshes when dirtyChannels() reports a change.
+  // The frame is generated column by column and written to the framebuffer in bursts.
+  // Returns once the refresh started, TASK_DISPLAY powers the panel down when it's done.
+  char footer[20] = "";
+#ifdef STATS_ON_DISPLAY
+  // awake time of the last cycle and the charge used so far, like 0.4s 120mAh
+  utoa(last_cpu_awake_ms/1000, footer, 10);
+  char tenths[5] = {'.', (char)('0' + last_cpu_awake_ms/100 % 10), 's', ' ', '\0'};
+  strcat(footer, tenths);
+  utoa(chargeMah(), footer + strlen(footer), 10);
+  strcat_P(footer, PSTR("mAh"));
+#endif
+  char vcc[7]; // like 3.41v
+  utoa(supply.millivolts/1000, vcc, 10);
+  const uint8_t centivolts = supply.millivolts/10 % 100;
+  char fraction[5] = {'.', (char)('0' + centivolts/10), (char)('0' + centivolts % 10), 'v', '\0'};
+  strcat(vcc, fraction);
+  display_powered_ms = nowMs();
+  halDisplayOn();
+  // rendering and the transfers to SRAM and panel only depend on the core clock, and
+  // the display draws more than the core, so it's cheaper to get them done quickly
+  halClockFast();
+  const uint32_t fast = nowMs();
+  DisplayColumn_T column;
+  for (uint8_t x = 0; x < DISPLAY_SIZE; x++) {
+    renderColumn(x, column, footer, vcc);
+    halDisplayColumn(x, column);
+  }
   // draw
-  display.display();
-  display.powerDown();
-  digitalWrite(DISP_ENA, LOW);
+  halDisplayRefresh();
+  halClockSlow();
+  bookCharge(LOAD_FAST, nowMs() - fast);
+  for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
+    displayed_state[i].moisture_level           = channel_state[i].moisture_level;
+    displayed_state[i].moisture_reference_level = channel_state[i].moisture_reference_level;
+    displayed_state[i].moisture_level_raw       = channel_state[i].moisture_level_raw;
+    displayed_state[i].pump_attempts            = channel_state[i].pump_attempts;
+    displayed_state[i].over_budget              = budgetLeft(i) == 0;
+    displayed_state[i].fault                    = health[i].fault;
+  }
+  display_valid = true;
+  supply.displayed_level = supply.shed_level;
+  supply.minutes_since_refresh = 0;
+  stats.display_refreshes++;
 }
+#endif
 
 
-void runPumps() {
+void planPumps() {
+  // pump seconds of this cycle per channel, only for channels that are too dry and have attempts left
+  // a weak battery gets shorter pulses, so it sags for a shorter time
+  const boolean shed = supply.shed_level >= SHED_PUMP;
+  pumping.slice_sec = shed ? max(1, PUMP_SLICE_SEC/2) : PUMP_SLICE_SEC;
+  pumping.pending = 0;
+  pumping.channel = 0;
+  pumping.unmeasured = 0;
+  pumping.attempted = 0;
   for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
-    if (channel_state[i].moisture_level < channel_state[i].moisture_reference_level) {
-      if (channel_state[i].pump_attempts < channel_state[i].max_pump_attempts) {
-        channel_state[i].pump_attempts += 1;
-#ifdef DEBUG
-        Serial.print("Channel ");
-        Serial.print(i+1);
-        Serial.print(" running pump for ");
-        Serial.print(channel_state[i].pump_duration);
-        Serial.println(" sec");
-#endif
-        setDecoder(channel_state[i].pump_dec); // pump on
-        delay(channel_state[i].pump_duration*1000/clk_scaler);
-        digitalWrite(DEC_EN, LOW); // pump off
+    pumping.remaining[i] = 0;
+    pumping.pumped[i] = 0;
+    const ChannelConfig_T config = channelConfig(i);
+    if (supply.shed_level >= SHED_PUMPS_OFF) {
+      continue;
+    }
+    if (!needsWater(i)) {
+      health[i].judge = false;
+      continue;
+    }
+    if (health[i].judge) {
+      health[i].judge = false;
+      if (channel_state[i].moisture_level < health[i].pumped_from + FAULT_RESPONSE_POINTS) {
+        setFault(i, FAULT_NO_WATER); // the water doesn't reach the sensor, pump or reservoir failed
+        continue;
+      }
+      // the water arrives, it just wasn't enough. Another round, the pump budget bounds a channel that never gets there
+      channel_state[i].pump_attempts = 0;
+    }
+    if (channel_state[i].pump_attempts < config.max_pump_attempts) {
+      if (channel_state[i].pump_attempts == 0) {
+        health[i].pumped_from = channel_state[i].moisture_level;
       }
+      // a run cut short by the budget isn't an attempt, the channel goes on at the rate of its budget
+      const uint8_t duration = shed ? (config.pump_duration + 1)/2 : config.pump_duration;
+      pumping.remaining[i] = min(duration, budgetLeft(i));
+      channel_state[i].pump_attempts += pumping.remaining[i] == duration;
+      pumping.attempted |= (pumping.remaining[i] == duration) << i;
+      health[i].judge = channel_state[i].pump_attempts == config.max_pump_attempts;
+      pumping.pending += pumping.remaining[i] > 0;
+#ifdef DEBUG
+      Serial.print(F("Channel "));
+      Serial.print(i+1);
+      Serial.print(F(" running pump for "));
+      Serial.print(pumping.remaining[i]);
+      Serial.println(F(" sec"));
+#endif
+    }
 #ifdef DEBUG
-      else {
-        Serial.print("Channel ");
-        Serial.print(i+1);
-        Serial.print(" exceeded maximum number of attempts ");
-        Serial.println(channel_state[i].max_pump_attempts);
+    else {
+      Serial.print(F("Channel "));
+      Serial.print(i+1);
+      Serial.print(F(" exceeded maximum number of attempts "));
+      Serial.println(config.max_pump_attempts);
+    }
+    if (budgetLeft(i) == 0) {
+      Serial.print(F("Channel "));
+      Serial.print(i+1);
+      Serial.println(F(" used up its pump budget"));
+    }
+#endif
+  }
+}
+
+
+void endPumps() {
+  for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
+    if (pumping.pumped[i]) {
+      doses[i].doses++;
+      storeDose(i);
+      // the drying goes on from the level measured after soaking, without that the water hides it until the next cycle
+      drying[i].baseline = (pumping.unmeasured & (1 << i)) ? DRYING_NO_BASELINE : drying[i].level;
+      historyLogPump(i, pumping.pumped[i]);
+#ifdef TELEMETRY
+      telemetryPump(i, pumping.pumped[i]);
+#endif
+    }
+  }
+  taskEnd(TASK_PUMP);
+}
+
+
+void stepPump(uint8_t state) {
+  // The decoder only drives one pump at a time. Dry channels take turns in slices
+  // of PUMP_SLICE_SEC so every channel gets some water early, and the MCU sleeps
+  // while a pump runs. With CLOSED_LOOP_WATERING the pumped channels are measured
+  // again after every round and stop as soon as they reach their reference level,
+  // so an attempt doesn't need to wait for the next cycle to be judged.
+  switch (state) {
+  case PUMP_PLAN:
+    planPumps();
+    break;
+  case PUMP_OFF:
+    halDecoderOff(); // pump off
+    bookCharge(LOAD_PUMP, nowMs() - pumping.powered_ms);
+    pumping.remaining[pumping.channel] -= pumping.slice;
+    pumping.pumped[pumping.channel] += pumping.slice;
+    pumping.unmeasured |= 1 << pumping.channel;
+    doses[pumping.channel].pump_seconds += pumping.slice;
+    doses[pumping.channel].bucket_q4 += pumping.slice*16;
+    stats.pump_seconds += pumping.slice;
+    pumping.pending -= pumping.remaining[pumping.channel] == 0;
+    pumping.channel++;
+    break;
+  case PUMP_SOAKED:
+    measuring.mask = 0;
+    for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
+      measuring.mask |= (pumping.remaining[i] > 0) << i;
+    }
+    pumping.unmeasured &= ~measuring.mask;
+    measuring.restart = measuring.mask;
+    taskCall(TASK_PUMP, PUMP_JUDGE, TASK_MEASURE);
+    return;
+  case PUMP_JUDGE:
+    for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
+      if (pumping.remaining[i] > 0 && !needsWater(i)) {
+        pumping.remaining[i] = 0;
+        pumping.pending--;
       }
+    }
+    pumping.channel = 0;
+    break;
+  }
+  if (!pumping.pending) {
+    endPumps(); // with closed loop watering the budget is used up, the next cycle judges the last round
+    return;
+  }
+  // next slice of the round
+  while (pumping.channel < NUMBER_OF_CHANNELS && pumping.remaining[pumping.channel] == 0) {
+    pumping.channel++;
+  }
+  if (pumping.channel == NUMBER_OF_CHANNELS) {
+#ifdef CLOSED_LOOP_WATERING
+    taskWait(TASK_PUMP, PUMP_SOAKED, (uint32_t)SOAK_SEC*1000);
+#else
+    pumping.channel = 0;
+    taskWait(TASK_PUMP, PUMP_ROUND, 0);
 #endif
+    return;
+  }
+  halSetDecoder(channelConfig(pumping.channel).pump_dec); // pump on
+  pumping.powered_ms = nowMs();
+  if (halSupplyMillivolts() < VCC_PUMP_MIN_MV) {
+    // the battery can't carry the pump, stop all pumping before a brown-out reset
+    halDecoderOff();
+    bookCharge(LOAD_PUMP, nowMs() - pumping.powered_ms);
+    for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
+      // a channel that got no water yet gets its attempt back, and there's nothing to judge
+      if ((pumping.attempted & (1 << i)) && pumping.pumped[i] == 0) {
+        channel_state[i].pump_attempts--;
+        health[i].judge = false;
+      }
     }
+    supply.pump_lock_mv = supply.millivolts + VCC_HYSTERESIS_MV;
+    supply.shed_level = SHED_PUMPS_OFF;
+    endPumps();
+    return;
   }
+  pumping.slice = min(pumping.remaining[pumping.channel], pumping.slice_sec);
+  taskWait(TASK_PUMP, PUMP_OFF, (uint32_t)pumping.slice*1000);
 }
 
-void loop() {
-  boolean hasStateUpdate = updateState();
-  if (hasStateUpdate) {
+
+uint8_t nextSleepMinutes() {
+  // Without PREDICTIVE_WATERING the cycle wakes about half way to the predicted crossing of
+  // the reference level of the channel that dries out the fastest. With it, it wakes when the
+  // channel comes within PREDICT_LEAD_MINUTES of the crossing and waters it then.
+  // Either way within SLEEP_MIN/MAX_MINUTES.
+  if (supply.shed_level >= SHED_SLEEP) {
+    return SLEEP_MAX_MINUTES;
+  }
+  uint16_t minutes = SLEEP_MAX_MINUTES;
+  for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
+    const uint8_t level     = channel_state[i].moisture_level;
+    const uint8_t reference = channel_state[i].moisture_reference_level;
+    if (health[i].fault != FAULT_NONE) {
+      continue;
+    }
+    if (level < reference) {
+      if (channel_state[i].pump_attempts < channelConfig(i).max_pump_attempts) {
+        minutes = min(minutes, SLEEP_DEFAULT_MINUTES); // keep the usual pace for pump retries
+      }
+      continue;
+    }
+    const uint16_t eta = minutesToReference(i);
+    if (eta != DRYING_NO_PREDICTION) {
+#ifdef PREDICTIVE_WATERING
+      minutes = min(minutes, eta > PREDICT_LEAD_MINUTES ? eta - PREDICT_LEAD_MINUTES : 0);
+#else
+      minutes = min(minutes, eta/2);
+#endif
+    } else if (level - reference < STABLE_MARGIN || drying[i].cycles < DRYING_MIN_CYCLES) {
+      minutes = min(minutes, SLEEP_DEFAULT_MINUTES);
+    }
+  }
+  return max(SLEEP_MIN_MINUTES, minutes);
+}
+
+
+void stepCycle(uint8_t state) {
+  switch (state) {
+  case CYCLE_SENSE:
+    endCycle();
+    cycle.cpu_start = halMillis();
+    cycle.phase_start = nowMs();
+    measureSupply();
+    drainBudgets();
+    measuring.mask = channelsToMeasure();
+    measuring.restart = pumping.unmeasured; // the water of the last slices arrived while the MCU slept
+    taskCall(TASK_CYCLE, CYCLE_LOG, TASK_MEASURE);
+    break;
+  case CYCLE_LOG:
+    cycle.phase_start = endPhase(PHASE_SENSE, cycle.phase_start);
+    recordDrying();
+    historyLogSample(sleep_minutes);
+    cycle.phase_start = endPhase(PHASE_LOG, cycle.phase_start);
+    taskCall(TASK_CYCLE, CYCLE_DISPLAY, TASK_PUMP);
+    break;
+  case CYCLE_DISPLAY: {
+    cycle.phase_start = endPhase(PHASE_PUMP, cycle.phase_start);
+#ifndef HEADLESS
+    // refresh only on visible change, a dry channel that gave up doesn't need a new picture every cycle
+    uint8_t dirty = dirtyChannels();
+#ifdef DEBUG
+    Serial.print(F("Display dirty channels 0x"));
+    Serial.println(dirty, HEX);
+#endif
+    if (displayDue(dirty)) {
+      taskCall(TASK_CYCLE, CYCLE_END, TASK_DISPLAY);
+      break;
+    }
+#endif
+    taskWait(TASK_CYCLE, CYCLE_END, 0);
+    break;
+  }
+  case CYCLE_END:
+#ifndef HEADLESS
+    endPhase(PHASE_DISPLAY, cycle.phase_start);
+#endif
+    telemetryEndCycle();
+    last_cpu_awake_ms = min(halMillis() - cycle.cpu_start, 0xFFFF);
+    stats.wakes++;
+    if (stats.sleep_seconds/STATS_SAVE_SECONDS != stats_saved_period) {
+      saveStats();
+    }
+    printStats();
+#ifdef DEBUG
+    Serial.print(F("Finished cycle. Going to sleep, adaptive sleep would be "));
+    Serial.print(nextSleepMinutes());
+    Serial.println(F(" min"));
+    taskWait(TASK_CYCLE, CYCLE_SLEEP, 8000);
+#else
+    sleep_minutes = nextSleepMinutes();
+    supply.minutes_since_refresh = min(supply.minutes_since_refresh + sleep_minutes, 0xFFFF);
+    serial_listen = true;
+    taskWait(TASK_CYCLE, CYCLE_SLEEP, (uint32_t)sleep_minutes*60000);
+#endif
+    break;
+  case CYCLE_SLEEP:
+#ifdef DEBUG
+    Serial.println(F("Woke up. Starting new cycle."));
+#endif
+    taskEnd(TASK_CYCLE);
+    break;
+  }
+}
+
+
+#ifndef HEADLESS
+void stepDisplay(uint8_t state) {
+  // the MCU sleeps during the refresh, runTasks() makes DISPLAY_WAIT due when EPD_BUSY goes low
+  if (state == DISPLAY_UPDATE) {
     updateDisplay();
-    runPumps();
+    taskWait(TASK_DISPLAY, DISPLAY_WAIT, DISPLAY_TIMEOUT_MS);
+    return;
+  }
+  halDisplayOff();
+  bookCharge(LOAD_DISPLAY, nowMs() - display_powered_ms);
+  taskEnd(TASK_DISPLAY);
+}
+#endif
+
+
+void stepTask(uint8_t t) {
+  const uint8_t state = tasks[t].state;
+  switch (t) {
+  case TASK_CYCLE:
+    stepCycle(state);
+    break;
+  case TASK_MEASURE:
+    stepMeasure(state);
+    break;
+  case TASK_PUMP:
+    stepPump(state);
+    break;
+#ifndef HEADLESS
+  case TASK_DISPLAY:
+    stepDisplay(state);
+    break;
+#endif
+#ifdef TELEMETRY
+  case TASK_TELEMETRY:
+    stepTelemetry(state);
+    break;
+#endif
   }
+}
+
+
+void idle(uint32_t ms, boolean cycle_sleep) {
+  // Waits for the next task, a powered sensor or pump stays on as in sleepWithDecoderOn().
+  // cycle_sleep: only the sleep between two cycles is left.
 #ifdef DEBUG
-  Serial.println("Finished cycle. Going to sleep");
-  //Watchdog.sleep(2000);
-  delay(1000);
-  Serial.println("Woke up. Starting new cycle.");
+  (void)cycle_sleep;
+  halDelay(min(ms, 1000)); // no sleep with DEBUG, see sleepWithDecoderOn()
 #else
-  // sleep for 10mins. Longest watchdog-sleep is 8s so we loop a few times
-  for (uint8_t i = 0; i < 10*60/8; i++) {
-    Watchdog.sleep(8000);
+#ifdef SERIAL_PROTOCOL
+  // a host on the serial port can end the sleep between two cycles early, the rest is slept after serving it
+  const boolean serial = cycle_sleep && serial_listen;
+#else
+  const boolean serial = false;
+#endif
+  uint8_t wake_pins = serial ? HAL_WAKE_SERIAL : 0;
+#ifndef HEADLESS
+  wake_pins |= tasks[TASK_DISPLAY].state == DISPLAY_WAIT ? HAL_WAKE_DISPLAY : 0;
+#endif
+  const uint32_t slept = sleepMs(ms, wake_pins);
+  if (cycle_sleep) {
+    stats.sleep_seconds += slept/1000;
+  }
+#ifdef SERIAL_PROTOCOL
+  if (serial && halSerialWoke()) {
+    serial_listen = serveSerial(PROTOCOL_IDLE_MS);
+    return;
+  }
+#endif
+  if (slept == 0 && !wake_pins) {
+    halDelay(ms); // shorter than a watchdog period
+  }
+#endif
+}
+
+
+void runTasks() {
+  // runs the task that is due first, or idles until it is due
+  const uint32_t awake = halMillis() - tasks_awake_ms;
+  stats.cpu_awake_ms += awake;
+  bookCharge(LOAD_AWAKE, awake);
+  tasks_awake_ms += awake;
+  const uint32_t now = nowMs();
+#ifndef HEADLESS
+  if (tasks[TASK_DISPLAY].state == DISPLAY_WAIT && !halDisplayBusy()) {
+    tasks[TASK_DISPLAY].due_ms = now; // the timeout is only the fallback
+  }
+#endif
+  uint8_t next = TASK_NONE;
+  boolean cycle_sleep = true;
+  for (uint8_t t = 0; t < NUMBER_OF_TASKS; t++) {
+    if (tasks[t].state == TASK_IDLE || tasks[t].waiting) {
+      continue;
+    }
+    cycle_sleep &= t == TASK_CYCLE && tasks[t].state == CYCLE_SLEEP;
+    if (next == TASK_NONE || (int32_t)(tasks[t].due_ms - tasks[next].due_ms) < 0) {
+      next = t;
+    }
+  }
+  if (next == TASK_NONE) {
+    return;
+  }
+  const int32_t wait = tasks[next].due_ms - now;
+  if (wait > 0) {
+    idle(wait, cycle_sleep);
+  } else {
+    stepTask(next);
+  }
+}
+
+
+void setup() {
+  halBegin(sensor_input_mask | (1 << (MOIST_REF - A0)));
+#ifdef SERIAL_PROTOCOL
+  halSerialBegin();
+#endif
+#ifdef DEBUG
+  Serial.print(F("Soil Moisture Guard "));
+  Serial.println(F(VERSION));
+#endif
+  for (uint8_t i = 0; i < NUMBER_OF_CHANNELS; i++) {
+    // init values
+    channel_state[i].moisture_level = 99;
+    channel_state[i].moisture_reference_level = 25;
+    drying[i].baseline = DRYING_NO_BASELINE;
+  }
+  loadSettings();
+  loadDoses();
+  loadCalibration();
+  loadStats();
+  historyBegin();
+#ifdef TELEMETRY
+  halRadioBegin();
+#endif
+  if (halButtonPressed()) {
+    runCalibration();
+  }
+#ifdef SERIAL_PROTOCOL
+  serveSerial(PROTOCOL_BOOT_LISTEN_MS);
+#endif
+  tasks_awake_ms = halMillis(); // the scheduler books the awake time from here
+}
+
+
+void loop() {
+  // one cycle including the sleep after it, the work is done by the tasks
+  taskStart(TASK_CYCLE);
+  while (tasks[TASK_CYCLE].state != TASK_IDLE) {
+    runTasks();
   }
-#endif  
 }
@@ -0,0 +1,491 @@
+/***************************************************
+ Host simulation of the Soil Moisture Guard
+
+ Implements hal.h against a simple soil, sensor and
+ energy model and runs setup()/loop() of main.cpp
+ in simulated time, as fast as the host allows.
+
+ pio run -e native
+ .pio/build/native/program [days] [seed] [battery mAh] [failure...]
+
+ Prints the energy per day, the pump seconds and
+ how long each plant was outside of its band. Without
+ a battery capacity the board runs from a steady
+ supply, with one the run ends when the battery is flat.
+ A failure is kind:channel[:from day:to day], like
+ leak:4 for a channel that leaks for the whole run
+ or dry:2:50:150 for a pump that runs dry from day 50
+ to day 150.
+ ****************************************************/
+
+#include <math.h>
+#include <stdio.h>
+#include "../hal.h"
+
+#define SIM_CHANNELS (DEC_OUTPUTS/2)
+
+// sensor, same defaults as WET_MEASUREMENT/DRY_MEASUREMENT in main.cpp
+#define SIM_WET_RAW 150
+#define SIM_DRY_RAW 660
+#define SIM_NOISE_COUNTS 3 // uniform noise of the sensor, +-ADC counts
+#define SIM_READING_NOISE_COUNTS 4 // uniform offset of all samples of a reading, the oscillator settles a bit differently every power up
+#define SIM_SPIKE_PER_MILLE 5      // readings that are off by SIM_SPIKE_COUNTS, like a loose contact
+#define SIM_SPIKE_COUNTS   60
+
+// soil
+#define SIM_START_MOISTURE 60.0
+#define SIM_DIURNAL 0.8                // drying rate swings by +-80% over the day, fastest at 15:00
+#define SIM_PUMP_PERCENT_PER_SEC 0.5   // moisture added per pump second
+#define SIM_SOAK_TAU_SEC 20.0          // time constant for the water to reach the sensor
+#define SIM_DRY_BAND 5                 // a plant more than this many points below its reference counts as too dry
+#define SIM_WET_BAND 20                // a plant more than this many points above its reference counts as too wet
+#define SIM_STEP_MS 1000               // integration step of the soil model while water moves ..
+#define SIM_DRY_STEP_MS 60000          // .. and while it only dries
+
+// injected failures
+#define SIM_LEAK_PER_HOUR 8.0 // drying rate at 50% moisture of a pot that leaks or a sensor that fell out of the soil
+#define SIM_STUCK_RAW     500 // a sensor with a dead oscillator, same output every time
+#define SIM_MAX_FAILURES  8
+
+// current draw in mA, supply side
+#define SIM_SLEEP_MA   0.05 // power down with the watchdog and the regulator
+#define SIM_AWAKE_MA   1.5  // ATmega328P at 2MHz
+#define SIM_FAST_MA    4.5  // .. and at 8MHz with halClockFast()
+#define SIM_FAST_SPEEDUP 4  // what runs on the core and over SPI takes a quarter of the time then
+#define SIM_SENSOR_MA  5.0  // one capacitive sensor and the potentiometer
+#define SIM_PUMP_MA    150.0
+#define SIM_DISPLAY_MA 5.0  // panel and SRAM while DISP_ENA is on
+#define SIM_RADIO_MA   45.0 // RFM69 transmitting at +13dBm
+
+// battery, 3 alkaline cells straight on VCC, the voltage drops linearly with the charge used
+#define SIM_SUPPLY_MV       5000 // without a battery
+#define SIM_BATTERY_FULL_MV 4650
+#define SIM_BATTERY_EMPTY_MV 3000
+#define SIM_BATTERY_OHM      2.0 // internal resistance, a weak battery sags under the pump
+#define SIM_BROWN_OUT_MV    2700 // BOD level of the Nano fuses
+
+// timing of the things the MCU waits for awake
+#define SIM_ADC_CONVERSION_US 104    // 13 ADC clocks at 125kHz
+#define SIM_COLUMN_US         500    // one framebuffer column over SPI, at 2MHz
+#define SIM_TRANSFER_MS       200    // display() shifting both planes from SRAM to the panel, at 2MHz
+#define SIM_DISPLAY_REFRESH_MS 15000 // tricolor refresh, EPD_BUSY is high
+#define SIM_RADIO_BPS          4800  // plus 3 bytes preamble, 2 sync, 1 length and 2 CRC per packet
+
+enum { LOAD_SLEEP, LOAD_AWAKE, LOAD_SENSORS, LOAD_PUMPS, LOAD_DISPLAY, LOAD_RADIO, NUMBER_OF_LOADS };
+const char* const load_names[] = {"sleep", "awake", "sensors", "pumps", "display", "radio"};
+
+struct Soil_T {
+  double moisture;     // percent
+  double in_transit;   // pumped water that hasn't reached the sensor yet, percent
+  double dry_per_hour; // percent per hour at 50% moisture, on average over the day
+  uint8_t reference;   // potentiometer setting, percent
+  uint64_t too_dry_ms;
+  uint64_t too_wet_ms;
+  uint64_t pump_ms;
+};
+
+enum { SIM_LEAK, SIM_SHORT, SIM_STUCK, SIM_DRY, SIM_FAILURE_KINDS };
+const char* const failure_names[] = {"leak", "short", "stuck", "dry"}; // dry: the pump runs but no water arrives
+
+struct SimFailure_T {
+  uint8_t kind;
+  uint8_t channel;
+  uint64_t from_ms;
+  uint64_t to_ms;
+};
+
+SimFailure_T failures[SIM_MAX_FAILURES];
+uint8_t failure_count = 0;
+
+Soil_T soil[SIM_CHANNELS] = {
+  // moisture,           transit, dry/h, reference
+  {SIM_START_MOISTURE, 0, 0.3, 30, 0, 0, 0},
+  {SIM_START_MOISTURE, 0, 0.6, 40, 0, 0, 0},
+  {SIM_START_MOISTURE, 0, 1.0, 50, 0, 0, 0},
+  {SIM_START_MOISTURE, 0, 1.5, 35, 0, 0, 0}
+};
+
+EEPROMClass EEPROM;
+
+uint64_t sim_ms = 0;    // simulated time
+uint64_t soil_ms = 0;   // the soil model lags behind sim_ms until the next look at it
+uint32_t awake_ms = 0;  // what millis() would show
+double rest_ms = 0;     // time below 1ms not yet added to the clocks
+double charge[NUMBER_OF_LOADS]; // mA*ms
+boolean decoder_on = false;
+uint8_t decoder_val = 0;
+boolean display_on = false;
+boolean clock_fast = false;
+boolean radio_on = false;
+uint64_t radio_sent_ms = 0; // end of the airtime of the packet being sent
+uint32_t display_refreshes = 0;
+uint64_t display_ready_ms = 0; // EPD_BUSY goes low
+uint32_t radio_packets = 0;
+uint32_t radio_bytes = 0;
+uint32_t random_state = 1;
+uint32_t battery_mah = 0;   // 0 = steady supply
+uint32_t brown_outs = 0;    // times VCC sagged below SIM_BROWN_OUT_MV
+
+
+uint32_t simRandom() {
+  // xorshift32, reproducible for a given seed
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return random_state;
+}
+
+
+boolean simParseFailure(const char* arg) {
+  char name[8];
+  unsigned channel, from = 0, to = 0;
+  const int fields = sscanf(arg, "%7[a-z]:%u:%u:%u", name, &channel, &from, &to);
+  if (fields != 2 && fields != 4) {
+    return false;
+  }
+  for (uint8_t k = 0; k < SIM_FAILURE_KINDS; k++) {
+    if (strcmp(name, failure_names[k]) == 0 && channel >= 1 && channel <= SIM_CHANNELS && failure_count < SIM_MAX_FAILURES) {
+      failures[failure_count++] = {k, (uint8_t)(channel - 1), (uint64_t)from*24*3600000, fields == 4 ? (uint64_t)to*24*3600000 : UINT64_MAX};
+      return true;
+    }
+  }
+  return false;
+}
+
+
+boolean simFailing(uint8_t kind, uint8_t c, uint64_t ms) {
+  for (uint8_t f = 0; f < failure_count; f++) {
+    if (failures[f].kind == kind && failures[f].channel == c && ms >= failures[f].from_ms && ms < failures[f].to_ms) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+void simSoil(uint32_t ms) {
+  const double dt_sec = ms/1000.0;
+  const double hour = fmod(soil_ms/3600000.0, 24.0);
+  const double diurnal = 1.0 + SIM_DIURNAL*sin(2*M_PI*(hour - 9.0)/24.0);
+  for (uint8_t c = 0; c < SIM_CHANNELS; c++) {
+    Soil_T& s = soil[c];
+    if (decoder_on && decoder_val == PUMP_DEC(c)) {
+      s.in_transit += simFailing(SIM_DRY, c, soil_ms) ? 0 : SIM_PUMP_PERCENT_PER_SEC*dt_sec;
+      s.pump_ms += ms;
+    }
+    const double inflow = s.in_transit > 0 ? s.in_transit*(1.0 - exp(-dt_sec/SIM_SOAK_TAU_SEC)) : 0;
+    s.in_transit -= inflow;
+    // wet soil dries faster than dry soil
+    const double dry_per_hour = simFailing(SIM_LEAK, c, soil_ms) ? SIM_LEAK_PER_HOUR : s.dry_per_hour;
+    s.moisture += inflow - dry_per_hour*diurnal*(s.moisture/50.0)*dt_sec/3600.0;
+    s.moisture = min(100.0, max(0.0, s.moisture));
+    if (s.moisture < s.reference - SIM_DRY_BAND) {
+      s.too_dry_ms += ms;
+    } else if (s.moisture > s.reference + SIM_WET_BAND) {
+      s.too_wet_ms += ms;
+    }
+  }
+}
+
+
+boolean simWaterMoving() {
+  boolean moving = decoder_on && decoder_val < SIM_CHANNELS;
+  for (uint8_t c = 0; c < SIM_CHANNELS; c++) {
+    moving |= soil[c].in_transit > 0.01;
+  }
+  return moving;
+}
+
+
+void simSoilCatchUp() {
+  // called before the decoder changes and before the soil is measured
+  while (soil_ms < sim_ms) {
+    const uint32_t step = min(sim_ms - soil_ms, (uint64_t)(simWaterMoving() ? SIM_STEP_MS : SIM_DRY_STEP_MS));
+    simSoil(step);
+    soil_ms += step;
+  }
+  for (uint8_t c = 0; c < SIM_CHANNELS; c++) {
+    soil[c].in_transit = soil[c].in_transit > 0.01 ? soil[c].in_transit : 0;
+  }
+}
+
+
+void simAdvance(double ms, boolean awake) {
+  // books ms of simulated time with the loads that are on
+  charge[awake ? LOAD_AWAKE : LOAD_SLEEP] += (awake ? (clock_fast ? SIM_FAST_MA : SIM_AWAKE_MA) : SIM_SLEEP_MA)*ms;
+  if (decoder_on) {
+    const boolean sensor = decoder_val >= SIM_CHANNELS;
+    charge[sensor ? LOAD_SENSORS : LOAD_PUMPS] += (sensor ? SIM_SENSOR_MA : SIM_PUMP_MA)*ms;
+  }
+  if (display_on) {
+    charge[LOAD_DISPLAY] += SIM_DISPLAY_MA*ms;
+  }
+  if (radio_on) {
+    charge[LOAD_RADIO] += SIM_RADIO_MA*ms;
+  }
+  // the clocks tick in whole milliseconds, the rest is carried over
+  rest_ms += ms;
+  const uint32_t whole_ms = (uint32_t)rest_ms;
+  rest_ms -= whole_ms;
+  if (awake) {
+    awake_ms += whole_ms;
+  }
+  sim_ms += whole_ms;
+}
+
+
+double simLoadMa() {
+  double ma = clock_fast ? SIM_FAST_MA : SIM_AWAKE_MA;
+  if (decoder_on) {
+    ma += decoder_val >= SIM_CHANNELS ? SIM_SENSOR_MA : SIM_PUMP_MA;
+  }
+  return ma + (display_on ? SIM_DISPLAY_MA : 0) + (radio_on ? SIM_RADIO_MA : 0);
+}
+
+
+double simRestingMv() {
+  if (battery_mah == 0) {
+    return SIM_SUPPLY_MV;
+  }
+  double used_mah = 0;
+  for (uint8_t l = 0; l < NUMBER_OF_LOADS; l++) {
+    used_mah += charge[l]/3600000.0;
+  }
+  return SIM_BATTERY_FULL_MV - (SIM_BATTERY_FULL_MV - SIM_BATTERY_EMPTY_MV)*used_mah/battery_mah;
+}
+
+
+void halBegin(uint8_t analog_input_mask) {
+  (void)analog_input_mask;
+}
+
+
+uint32_t halMillis() {
+  return awake_ms;
+}
+
+
+void halDelay(uint16_t ms) {
+  simAdvance(ms, true);
+}
+
+
+uint32_t halSleep(uint32_t ms, uint8_t wake_pins) {
+  // there's no host on the simulated serial port, a refresh that ends wakes the MCU right away
+  const boolean display_wakes = wake_pins & HAL_WAKE_DISPLAY;
+  if (display_wakes) {
+    ms = sim_ms < display_ready_ms ? min(ms, display_ready_ms - sim_ms) : 0;
+  }
+  // the watchdog periods of hal_avr.cpp, the longest ones first
+  const uint16_t periods[] = {8000, 4000, 2000, 1000, 500, 250, 125, 64, 32, 16};
+  uint32_t slept = 0;
+  for (uint8_t p = 0; p < sizeof(periods)/sizeof(periods[0]); p++) {
+    const uint32_t n = (ms - slept)/periods[p];
+    simAdvance((double)n*periods[p], false);
+    slept += n*periods[p];
+  }
+  if (display_wakes) {
+    simAdvance(ms - slept, false); // the pin change ends a watchdog period early
+    slept = ms;
+  }
+  return slept;
+}
+
+
+void halClockFast() {
+  clock_fast = true;
+}
+
+
+void halClockSlow() {
+  clock_fast = false;
+}
+
+
+double simClockMs(double ms) {
+  // duration of work that runs on the core clock
+  return clock_fast ? ms/SIM_FAST_SPEEDUP : ms;
+}
+
+
+boolean halButtonPressed() {
+  return false;
+}
+
+
+void halSampleChannel(uint8_t sensor_analog_pin, uint16_t* sensor, uint16_t* reference, uint8_t count) {
+  // an input that isn't powered through the decoder reads 0
+  const uint8_t c = sensor_analog_pin - A0;
+  simSoilCatchUp();
+  const boolean powered = decoder_on && decoder_val == SENSOR_DEC(c) && c < SIM_CHANNELS;
+  int16_t offset = (int16_t)(simRandom() % (2*SIM_READING_NOISE_COUNTS + 1)) - SIM_READING_NOISE_COUNTS;
+  if (simRandom() % 1000 < SIM_SPIKE_PER_MILLE) {
+    offset += simRandom() % 2 ? SIM_SPIKE_COUNTS : -SIM_SPIKE_COUNTS;
+  }
+  for (uint8_t j = 0; j < count; j++) {
+    int16_t noise = offset + (int16_t)(simRandom() % (2*SIM_NOISE_COUNTS + 1)) - SIM_NOISE_COUNTS;
+    int16_t raw = SIM_DRY_RAW - (int16_t)(soil[c].moisture*(SIM_DRY_RAW - SIM_WET_RAW)/100.0) + noise;
+    if (simFailing(SIM_SHORT, c, sim_ms)) {
+      raw = 0;
+    } else if (simFailing(SIM_STUCK, c, sim_ms)) {
+      raw = SIM_STUCK_RAW;
+    }
+    sensor[j]    = powered ? min(1023, max(0, raw)) : 0;
+    reference[j] = powered ? min(1023, soil[c].reference*10 + 5) : 0;
+  }
+  simAdvance(2.0*count*SIM_ADC_CONVERSION_US/1000.0, true);
+}
+
+
+uint16_t halSupplyMillivolts() {
+  const double mv = simRestingMv() - (battery_mah ? simLoadMa()*SIM_BATTERY_OHM : 0);
+  brown_outs += mv < SIM_BROWN_OUT_MV;
+  return (uint16_t)max(0.0, mv);
+}
+
+
+void halDecoderOff() {
+  simSoilCatchUp();
+  decoder_on = false;
+}
+
+
+void halSetDecoder(uint8_t val) {
+  simSoilCatchUp();
+  decoder_val = val & (DEC_OUTPUTS - 1);
+  decoder_on = true;
+}
+
+
+#ifndef HEADLESS
+void halDisplayOn() {
+  display_on = true;
+}
+
+
+void halDisplayColumn(uint8_t x, DisplayColumn_T& column) {
+  (void)x;
+  (void)column;
+  simAdvance(simClockMs(SIM_COLUMN_US/1000.0), true);
+}
+
+
+void halDisplayRefresh() {
+  simAdvance(simClockMs(SIM_TRANSFER_MS), true);
+  display_ready_ms = sim_ms + SIM_DISPLAY_REFRESH_MS;
+  display_refreshes++;
+}
+
+
+boolean halDisplayBusy() {
+  return sim_ms < display_ready_ms;
+}
+
+
+void halDisplayOff() {
+  display_on = false;
+}
+
+
+void halDisplayMessage(const __FlashStringHelper* message, const char* details) {
+  (void)message;
+  (void)details;
+  halDisplayOn();
+  halDisplayRefresh();
+  simAdvance(SIM_DISPLAY_REFRESH_MS, true);
+  halDisplayOff();
+}
+#endif
+
+
+void halSerialBegin() {
+}
+
+
+int16_t halSerialRead() {
+  simAdvance(0.5, true); // a host would be polled for its next byte
+  return -1;
+}
+
+
+void halSerialWrite(const uint8_t* data, uint8_t length) {
+  (void)data;
+  (void)length;
+}
+
+
+boolean halSerialWoke() {
+  return false;
+}
+
+
+void halRadioBegin() {
+}
+
+
+boolean halRadioStart(const uint8_t* data, uint8_t length) {
+  (void)data;
+  radio_on = true;
+  radio_sent_ms = sim_ms + (uint64_t)((3 + 2 + 1 + length + 2)*8*1000.0/SIM_RADIO_BPS);
+  radio_packets++;
+  radio_bytes += length;
+  return true;
+}
+
+
+boolean halRadioSent() {
+  return sim_ms >= radio_sent_ms;
+}
+
+
+void halRadioSleep() {
+  radio_on = false;
+}
+
+
+int main(int argc, char** argv) {
+  const uint32_t days = argc > 1 ? atoi(argv[1]) : 365;
+  random_state = argc > 2 ? atoi(argv[2]) : 1;
+  random_state += !random_state; // xorshift gets stuck at 0
+  battery_mah = argc > 3 ? atoi(argv[3]) : 0;
+  for (int a = 4; a < argc; a++) {
+    if (!simParseFailure(argv[a])) {
+      fprintf(stderr, "unknown failure %s, expected kind:channel[:from day:to day]\n", argv[a]);
+      return 1;
+    }
+  }
+  const uint64_t end_ms = (uint64_t)days*24*3600000;
+  uint32_t cycles = 0;
+  setup();
+  while (sim_ms < end_ms && simRestingMv() > SIM_BATTERY_EMPTY_MV) {
+    loop();
+    cycles++;
+  }
+  simSoilCatchUp();
+
+  const double sim_days = sim_ms/(24*3600000.0);
+  double total = 0;
+  for (uint8_t l = 0; l < NUMBER_OF_LOADS; l++) {
+    total += charge[l];
+  }
+  printf("simulated %.1f days, %u cycles, %.1f cycles/day\n", sim_days, cycles, cycles/sim_days);
+  printf("energy   %8.2f mAh/day (", total/3600000.0/sim_days);
+  for (uint8_t l = 0; l < NUMBER_OF_LOADS; l++) {
+    printf("%s%s %.2f", l ? ", " : "", load_names[l], charge[l]/3600000.0/sim_days);
+  }
+  printf(")\n");
+  printf("display  %8.1f refreshes/day\n", display_refreshes/sim_days);
+  if (radio_packets) {
+    printf("radio    %8.1f packets/day, %.0f bytes/day\n", radio_packets/sim_days, radio_bytes/sim_days);
+  }
+  if (battery_mah) {
+    printf("battery  %8u mAh, %.2fV left, %u brown-outs under load\n", battery_mah, simRestingMv()/1000, brown_outs);
+  }
+  printf("eeprom   %8.1f byte writes/day\n", EEPROM.writes/sim_days);
+  printf("channel  reference  pump s/day  too dry  too wet\n");
+  for (uint8_t c = 0; c < SIM_CHANNELS; c++) {
+    printf("%7u  %8u%%  %10.1f  %6.2f%%  %6.2f%%\n", c + 1, soil[c].reference, soil[c].pump_ms/1000.0/sim_days,
+           100.0*soil[c].too_dry_ms/sim_ms, 100.0*soil[c].too_wet_ms/sim_ms);
+  }
+  return 0;
+}
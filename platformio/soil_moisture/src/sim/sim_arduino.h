@@ -0,0 +1,89 @@
+/***************************************************
+ The parts of the Arduino core and libraries the
+ control code in main.cpp uses, for the native
+ environment.
+ ****************************************************/
+
+#ifndef SIM_ARDUINO_H
+#define SIM_ARDUINO_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+
+class __FlashStringHelper;
+#define F(string_literal) (reinterpret_cast<const __FlashStringHelper*>(string_literal))
+#define PROGMEM
+#define PSTR(string_literal) (string_literal)
+#define memcpy_P memcpy
+#define strcat_P strcat
+#define strchr_P strchr
+#define strncpy_P strncpy
+#define pgm_read_byte(addr) (*(const uint8_t*)(addr))
+#define pgm_read_word(addr) (*(const uint16_t*)(addr))
+#define pgm_read_dword(addr) (*(const uint32_t*)(addr))
+
+// Arduino Nano
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+#define A6 20
+#define A7 21
+#define E2END 0x3FF
+
+enum { EPD_WHITE, EPD_BLACK, EPD_RED };
+
+inline uint16_t _crc_xmodem_update(uint16_t crc, uint8_t data) {
+  crc ^= (uint16_t)data << 8;
+  for (uint8_t b = 0; b < 8; b++) {
+    crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+inline char* utoa(unsigned value, char* string, int radix) {
+  char* p = string;
+  do {
+    unsigned digit = value % radix;
+    *p++ = digit < 10 ? '0' + digit : 'a' + digit - 10;
+    value /= radix;
+  } while (value);
+  *p = '\0';
+  for (char* q = string; q < --p; q++) {
+    char c = *q; *q = *p; *p = c;
+  }
+  return string;
+}
+
+// EEPROM library, put() only writes the bytes that changed like the AVR one
+struct EEPROMClass {
+  uint8_t data[E2END + 1];
+  uint32_t writes; // byte writes, for the wear estimate
+
+  EEPROMClass() : writes(0) { memset(data, 0xFF, sizeof(data)); }
+  uint8_t read(int idx) { return data[idx]; }
+  void write(int idx, uint8_t val) { data[idx] = val; writes++; }
+  void update(int idx, uint8_t val) { if (data[idx] != val) { write(idx, val); } }
+  template <typename T> T& get(int idx, T& t) { memcpy(&t, &data[idx], sizeof(T)); return t; }
+  template <typename T> const T& put(int idx, const T& t) {
+    for (unsigned i = 0; i < sizeof(T); i++) {
+      update(idx + i, ((const uint8_t*)&t)[i]);
+    }
+    return t;
+  }
+};
+extern EEPROMClass EEPROM;
+
+void setup();
+void loop();
+
+#endif